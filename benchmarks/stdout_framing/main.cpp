@@ -0,0 +1,116 @@
+// Measures how fast bridge messages are framed and dispatched by
+// PyInterpreterProcess::handleReadStandardOutput. Synthetic stream of
+// 'stdout' messages is fed through pipe by child process instead of
+// interpreter bridge, for several message sizes
+#include "pyinterpreterprocess.h"
+
+#include <QApplication>
+#include <QElapsedTimer>
+#include <QJsonObject>
+#include <QTemporaryFile>
+#include <QTimer>
+#include <QDebug>
+
+#include <cstdio>
+
+using namespace Python3Language;
+
+static const qint64 StreamSize = 100 * 1024 * 1024;
+static const int TimeoutMsec = 10 * 60 * 1000;
+
+class FramingBenchmark : public PyInterpreterProcess
+{
+public:
+    inline explicit FramingBenchmark(): PyInterpreterProcess(false) {}
+
+    // Output credit messages are written back to stdin, so it is read
+    // after stream file not to block on full pipe
+    inline void feed(const QString & fileName) {
+        start("sh", QStringList() << "-c" << "cat \"$1\"; exec cat >/dev/null" << "sh" << fileName);
+        waitForStarted();
+    }
+};
+
+// Writes stream of messages with given text size, returns total
+// number of characters in messages
+static qint64 writeStream(QFile & file, int textSize)
+{
+    // Program output is mostly ASCII, with some Cyrillic letters
+    QString text;
+    while (text.size() < textSize) {
+        text += QString::fromUtf8("x = 42, y = \xd0\xbf\xd1\x80\xd0\xb8\xd0\xb2\xd0\xb5\xd1\x82\n");
+    }
+    text.truncate(textSize);
+    QJsonObject obj;
+    obj["type"] = "stdout";
+    obj["string_data"] = text;
+    const QByteArray frame = QJsonDocument(obj).toJson(QJsonDocument::Compact) + "\n";
+    const qint64 count = StreamSize / frame.size();
+    QByteArray chunk;
+    for (int i=0; i<qMax(1, (1024 * 1024) / frame.size()); i++) {
+        chunk += frame;
+    }
+    const qint64 framesPerChunk = chunk.size() / frame.size();
+    qint64 written = 0;
+    while (written + framesPerChunk <= count) {
+        file.write(chunk);
+        written += framesPerChunk;
+    }
+    for (; written < count; written++) {
+        file.write(frame);
+    }
+    file.flush();
+    return count * text.size();
+}
+
+static bool measure(int textSize)
+{
+    QTemporaryFile file;
+    if (!file.open()) {
+        qDebug() << "Can't create stream file";
+        return false;
+    }
+    const qint64 expected = writeStream(file, textSize);
+    const qint64 streamSize = file.size();
+
+    FramingBenchmark process;
+    QEventLoop loop;
+    qint64 received = 0;
+    qint64 flushes = 0;
+    QObject::connect(&process, &PyInterpreterProcess::stdoutReceived, [&](const QString & message) {
+        received += message.size();
+        flushes ++;
+        if (received >= expected) {
+            loop.quit();
+        }
+    });
+    QTimer::singleShot(TimeoutMsec, &loop, SLOT(quit()));
+
+    QElapsedTimer timer;
+    timer.start();
+    process.feed(file.fileName());
+    loop.exec();
+    const qint64 elapsed = qMax(Q_INT64_C(1), timer.elapsed());
+    process.kill();
+    process.waitForFinished();
+
+    const bool ok = received == expected;
+    const double seconds = elapsed / 1000.0;
+    std::printf("%8d chars/message %8.1f MB/s %10.0f messages/s %8lld flushes  %s\n",
+                textSize,
+                double(streamSize) / (1024.0 * 1024.0) / seconds,
+                double(expected / textSize) / seconds,
+                static_cast<long long>(flushes),
+                ok ? "ok" : "FAILED");
+    return ok;
+}
+
+int main(int argc, char *argv[])
+{
+    QApplication app(argc, argv);
+    bool ok = true;
+    Q_FOREACH(int textSize, QList<int>() << 80 << 4096 << 256 * 1024) {
+        ok = measure(textSize) && ok;
+    }
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,128 @@
+"""
+Measures time from stop request to program finish in out-of-process mode.
+
+Starts interpreter bridge as IDE does, runs programs which stop in
+different ways and sends 'terminate_program' after a while. The bridge
+process is killed if program is not finished in KILL_TIMEOUT, as
+ProcessRunner does. Exits with non-zero status if some latency exceeds
+its limit.
+
+Usage: python3 termination_latency.py [python executable]
+"""
+
+import json
+import os
+import queue
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+BRIDGE_PATH = os.path.join(HERE, os.pardir, "share", "kumir2", "python3language")
+
+# Must match ProcessRunner::TerminateKillTimeout
+KILL_TIMEOUT = 0.5
+RUN_BEFORE_STOP = 0.3
+RING_SIZE = 64 + 1024 * 1024
+
+# Program source, limit of latency in seconds, expected kill
+CASES = [
+    ("busy loop", "while True:\n    pass\n", 0.1, False),
+    ("busy loop with calls",
+     "def f(x):\n    return x + 1\nn = 0\nwhile True:\n    n = f(n)\n", 0.1, False),
+    ("exception caught by program",
+     "while True:\n    try:\n        while True:\n            pass\n"
+     "    except BaseException:\n        pass\n", KILL_TIMEOUT + 0.2, True),
+    ("long C call",
+     "sum(range(10 ** 10))\n", KILL_TIMEOUT + 0.2, True),
+]
+
+
+class Bridge:
+    def __init__(self, python):
+        env = dict(os.environ)
+        env["PYTHONPATH"] = os.pathsep.join(filter(None, [BRIDGE_PATH, env.get("PYTHONPATH")]))
+        self.process = subprocess.Popen(
+            [python, "-m", "sandbox_bridge"], env=env,
+            stdin=subprocess.PIPE, stdout=subprocess.PIPE, stderr=subprocess.DEVNULL)
+        self.messages = queue.Queue()
+        threading.Thread(target=self._read, daemon=True).start()
+        self.send({"type": "ping"})
+        self.wait_for("pong", 30)
+
+    def _read(self):
+        for line in self.process.stdout:
+            try:
+                self.messages.put(json.loads(line))
+            except ValueError:
+                pass
+        self.messages.put({"type": "process_finished"})
+
+    def send(self, message):
+        self.process.stdin.write((json.dumps(message) + "\n").encode("utf-8"))
+        self.process.stdin.flush()
+
+    def wait_for(self, message_type, timeout):
+        deadline = time.monotonic() + timeout
+        while True:
+            left = deadline - time.monotonic()
+            if left <= 0:
+                return None
+            try:
+                message = self.messages.get(timeout=left)
+            except queue.Empty:
+                return None
+            if message["type"] in (message_type, "process_finished"):
+                return message
+
+    def kill(self):
+        self.process.kill()
+        self.process.wait()
+
+
+def measure(python, source, ring_path):
+    bridge = Bridge(python)
+    bridge.send({
+        "type": "run_program",
+        "program_path": "<program>",
+        "program": source,
+        "pre_run": "", "post_run": "", "pre_test": "", "post_test": "",
+        "testing": False,
+        "mode": "blind",
+        "breakpoints": [],
+        "modules": [],
+        "output_ring": ring_path,
+    })
+    time.sleep(RUN_BEFORE_STOP)
+    start = time.monotonic()
+    bridge.send({"type": "terminate_program"})
+    finished = bridge.wait_for("program_finished", KILL_TIMEOUT)
+    killed = finished is None or "process_finished" == finished["type"]
+    if killed:
+        bridge.kill()
+    latency = time.monotonic() - start
+    if not killed:
+        bridge.send({"type": "exit"})
+        bridge.process.wait()
+    return latency, killed
+
+
+def main():
+    python = sys.argv[1] if len(sys.argv) > 1 else sys.executable
+    with tempfile.NamedTemporaryFile() as ring:
+        ring.truncate(RING_SIZE)
+        failed = False
+        for name, source, limit, expect_kill in CASES:
+            latency, killed = measure(python, source, ring.name)
+            ok = latency <= limit and killed == expect_kill
+            failed = failed or not ok
+            print("{:32} {:8.1f} ms  {:6}  {}".format(
+                name, latency * 1000, "killed" if killed else "", "ok" if ok else "FAILED"))
+    return 1 if failed else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -1,11 +1,15 @@
+import os
 import sys
 import json
 import importlib
 import traceback
 from sandbox_console import interpreter
-import time
+from . import io_wrapper
+from . import program_runner
 import threading
-import queue
+import selectors
+import socket
+import collections
 
 
 cout = sys.__stdout__
@@ -16,27 +20,74 @@ exit = sys.exit
 preloaded_modules = {}
 
 globls = {}
-interp = interpreter.Interpreter()
 
 
-class NonBlockingReader(threading.Thread):
-    entries = queue.Queue()
+class Wakeup:
+    """Self-pipe to wake up main loop from other threads"""
 
-    def run(self):
+    def __init__(self):
+        # Socket pair is used rather than os.pipe() to be selectable on Windows
+        self.reader, self.writer = socket.socketpair()
+        self.reader.setblocking(False)
+        self.writer.setblocking(False)
+
+    def notify(self):
+        try:
+            self.writer.send(b"\0")
+        except OSError:
+            pass  # buffer is full, so main loop is going to wake up anyway
+
+    def drain(self):
+        try:
+            while self.reader.recv(4096):
+                pass
+        except OSError:
+            pass
+
+
+wakeup = Wakeup()
+interp = interpreter.Interpreter(wakeup.notify)
+
+
+class StdInReader:
+    """Splits incoming data into message lines"""
+
+    def __init__(self, selector):
+        self.lines = collections.deque()
+        self.eof = False
+        if os.name == "posix":
+            self.buffer = b""
+            self.fd = cin.fileno()
+            selector.register(self.fd, selectors.EVENT_READ, self)
+        else:
+            # Pipes are not selectable on Windows, so read them in a separate
+            # thread which wakes up main loop for each line received
+            threading.Thread(target=self._run_blocking_reader, daemon=True).start()
+
+    def read_available(self):
+        data = os.read(self.fd, 65536)
+        if not data:
+            self.eof = True
+            return
+        self.buffer += data
+        *complete, self.buffer = self.buffer.split(b"\n")
+        for line in complete:
+            self.lines.append(line.decode("utf-8"))
+
+    def _run_blocking_reader(self):
         while True:
-            try:
-                line = cin.readline().strip()
-                NonBlockingReader.entries.put(line)
-            except SystemExit:
-                break
-            except KeyboardInterrupt:
+            line = cin.readline()
+            if not line:
+                self.eof = True
+                wakeup.notify()
                 break
+            self.lines.append(line)
+            wakeup.notify()
 
-    @staticmethod
-    def readline():
+    def take_line(self):
         try:
-            return NonBlockingReader.entries.get(block=True, timeout=0.25)
-        except queue.Empty:
+            return self.lines.popleft().strip()
+        except IndexError:
             return None
 
 
@@ -93,37 +144,62 @@ def do_eval(async_id, eval_string):
     interp.runsource_separate_thread(async_id, eval_string)
 
 
+def do_exit(exit_code):
+    io_wrapper.finish_output()
+    cerr.write("exit({})\n".format(exit_code))
+    cerr.flush()
+    exit(exit_code)
+
+
+def handle_message(message_line):
+    message = json.loads(message_line)
+    cmd = message["type"].lower()
+    if "exit" == cmd:
+        do_exit(0)
+    elif "ping" == cmd:
+        do_pong()
+    elif "blocking_call" == cmd:
+        module_name = message["module_name"]
+        function_name = message["function_name"]
+        arguments = message["arguments"]
+        do_function_call(module_name, function_name, arguments)
+    elif "non_blocking_eval" == cmd:
+        eval_string = message["eval_string"]
+        async_id = message["async_id"]
+        do_eval(async_id, eval_string)
+    elif "input_response" == cmd:
+        data = message["data"]
+        sys.stdin.push(data)
+    elif "output_credit" == cmd:
+        io_wrapper.grant_output_credit(message["amount"])
+    elif "output_control" == cmd:
+        io_wrapper.set_output_limits(message["window"], message["tail_limit"])
+    elif program_runner.handle_message(cmd, message):
+        pass
+    else:
+        cerr.write("Unknown message type {}\n".format(cmd))
+        cerr.flush()
+
+
 def process():
-    NonBlockingReader(daemon=True).start()
+    # Main loop sleeps until there is either incoming data
+    # or some evaluation thread finished, no polling intervals
+    selector = selectors.DefaultSelector()
+    selector.register(wakeup.reader, selectors.EVENT_READ, wakeup)
+    reader = StdInReader(selector)
     while True:
         exit_code = interpreter.Interpreter.check_for_zombies()
         if exit_code is not None:
-            cerr.write("exit({})\n".format(exit_code))
-            cerr.flush()
-            exit(exit_code)
-        # message_line = str(cin.readline()).strip()
-        message_line = NonBlockingReader.readline()
-        if message_line:
-            message = json.loads(message_line)
-            cmd = message["type"].lower()
-            if "exit" == cmd:
-                cerr.write("exit({})\n".format(0))
-                cerr.flush()
-                exit(0)
-            elif "ping" == cmd:
-                do_pong()
-            elif "blocking_call" == cmd:
-                module_name = message["module_name"]
-                function_name = message["function_name"]
-                arguments = message["arguments"]
-                do_function_call(module_name, function_name, arguments)
-            elif "non_blocking_eval" == cmd:
-                eval_string = message["eval_string"]
-                async_id = message["async_id"]
-                do_eval(async_id, eval_string)
-            elif "input_response" == cmd:
-                data = message["data"]
-                sys.stdin.push(data)
+            do_exit(exit_code)
+        message_line = reader.take_line()
+        while message_line is not None:
+            if message_line:
+                handle_message(message_line)
+            message_line = reader.take_line()
+        if reader.eof:
+            do_exit(0)
+        for key, _ in selector.select():
+            if key.data is wakeup:
+                wakeup.drain()
             else:
-                cerr.write("Unknown message type {}\n".format(cmd))
-                cerr.flush()
+                key.data.read_available()
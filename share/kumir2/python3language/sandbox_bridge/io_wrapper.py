@@ -1,23 +1,158 @@
 import io
 import json
 import sys
+import time
 import builtins
 import threading
 
+
+# Output is collected and sent to IDE by frames rather than
+# one message per write() call, so flush on size or time threshold
+FLUSH_SIZE = 8192
+FLUSH_INTERVAL = 0.05
+
+# Number of characters sent but not yet rendered by IDE, after which
+# writing thread blocks until IDE grants credit by 'output_credit' message
+DEFAULT_WINDOW = 256 * 1024
+
+
+class OutputBuffer:
+    def __init__(self):
+        self.lock = threading.Lock()
+        self.chunks = []
+        self.size = 0
+        self.last_flush = time.monotonic()
+        self.pending = threading.Event()
+        self.flusher = None
+        self.credit = threading.Condition()
+        self.window = DEFAULT_WINDOW
+        self.unacknowledged = 0
+        # Tail only mode: once more than tail_limit characters sent
+        # until the end of current output session (input request or
+        # evaluation finished), only last tail_limit characters are kept
+        self.tail_limit = 0
+        self.session_sent = 0
+        self.tail = []
+        self.tail_size = 0
+        self.skipped = 0
+
+    def append(self, kind, msg):
+        self._wait_for_credit()
+        with self.lock:
+            if self.tail_limit and self.session_sent >= self.tail_limit:
+                self._append_to_tail(kind, msg)
+                return
+            if self.chunks and kind == self.chunks[-1][0]:
+                self.chunks[-1][1].append(msg)
+            else:
+                self.chunks.append((kind, [msg]))
+            self.size += len(msg)
+            overfull = self.size >= FLUSH_SIZE or \
+                time.monotonic() - self.last_flush >= FLUSH_INTERVAL
+            if not overfull and self.flusher is None:
+                self.flusher = threading.Thread(target=self._run_flusher, daemon=True)
+                self.flusher.start()
+        if overfull:
+            self.flush()
+        else:
+            self.pending.set()
+
+    def _wait_for_credit(self):
+        if threading.current_thread() is threading.main_thread():
+            return  # main thread processes credit messages, so never block it
+        with self.credit:
+            while self.window and self.unacknowledged + self.size >= self.window:
+                self.credit.wait()
+
+    def grant_credit(self, amount):
+        with self.credit:
+            self.unacknowledged = max(0, self.unacknowledged - amount)
+            self.credit.notify_all()
+
+    def set_limits(self, window, tail_limit):
+        with self.lock:
+            self.tail_limit = tail_limit
+        with self.credit:
+            self.window = window
+            self.credit.notify_all()
+
+    def _append_to_tail(self, kind, msg):
+        if self.tail and kind == self.tail[-1][0]:
+            self.tail[-1][1] += msg
+        else:
+            self.tail.append([kind, msg])
+        self.tail_size += len(msg)
+        while self.tail_size > self.tail_limit:
+            extra = self.tail_size - self.tail_limit
+            first = self.tail[0]
+            if len(first[1]) <= extra:
+                self.tail.pop(0)
+                dropped = len(first[1])
+            else:
+                first[1] = first[1][extra:]
+                dropped = extra
+            self.tail_size -= dropped
+            self.skipped += dropped
+
+    def finish_session(self):
+        with self.lock:
+            if self.skipped:
+                marker = "\n... {} characters skipped ...\n".format(self.skipped)
+                self.chunks.append(("stderr", [marker]))
+            for kind, msg in self.tail:
+                self.chunks.append((kind, [msg]))
+            self.session_sent = 0
+            self.tail = []
+            self.tail_size = 0
+            self.skipped = 0
+        self.flush(True)
+
+    def flush(self, finishing_session=False):
+        with self.lock:
+            chunks = self.chunks
+            self.chunks = []
+            self.size = 0
+            self.last_flush = time.monotonic()
+            if not chunks:
+                return
+            lines = []
+            sent = 0
+            for kind, parts in chunks:
+                env = {
+                    "type": kind,
+                    "string_data": "".join(parts)
+                }
+                sent += len(env["string_data"])
+                lines += [json.dumps(env, separators=(',', ':')) + "\n"]
+            if not finishing_session:
+                self.session_sent += sent
+            with self.credit:
+                self.unacknowledged += sent
+            sys.__stdout__.write("".join(lines))
+            sys.__stdout__.flush()
+
+    def _run_flusher(self):
+        while True:
+            self.pending.wait()
+            time.sleep(FLUSH_INTERVAL)
+            self.pending.clear()
+            self.flush()
+
+
+output_buffer = OutputBuffer()
+
+
 class StdOut(io.TextIOBase):
     def __init__(self):
         super().__init__()
 
     def write(self, *args, **kwargs):
         msg = args[0]
-        env = {
-            "type": "stdout",
-            "string_data": msg
-        }
-        raw = json.dumps(env, separators=(',', ':'))
-        sys.__stdout__.write(raw + "\n")
-        sys.__stdout__.flush()
+        output_buffer.append("stdout", msg)
+        return len(msg)
 
+    def flush(self):
+        output_buffer.flush()
 
 
 class StdErr(io.TextIOBase):
@@ -26,15 +161,11 @@ class StdErr(io.TextIOBase):
 
     def write(self, *args, **kwargs):
         msg = args[0]
-        env = {
-            "type": "stderr",
-            "string_data": msg
-        }
-        raw = json.dumps(env, separators=(',', ':'))
-        sys.__stdout__.write(raw + "\n")
-        sys.__stdout__.flush()
-
+        output_buffer.append("stderr", msg)
+        return len(msg)
 
+    def flush(self):
+        output_buffer.flush()
 
 
 class StdIn(io.TextIOBase):
@@ -44,6 +175,7 @@ class StdIn(io.TextIOBase):
         self.semaphore = threading.Semaphore(0)
 
     def readline(self, *args, **kwargs):
+        output_buffer.finish_session()
         msg = {
             "type": "input_request",
             "prompt": ""
@@ -68,6 +200,7 @@ class StdIn(io.TextIOBase):
 
 
 def modified_input(prompt):
+    output_buffer.finish_session()
     msg = {
         "type": "input_request",
         "prompt": prompt
@@ -77,6 +210,18 @@ def modified_input(prompt):
     sys.__stdout__.flush()
     return sys.stdin._fake_readline()
 
+def finish_output():
+    output_buffer.finish_session()
+
+
+def grant_output_credit(amount):
+    output_buffer.grant_credit(amount)
+
+
+def set_output_limits(window, tail_limit):
+    output_buffer.set_limits(window, tail_limit)
+
+
 def register():
     sys.stdout = StdOut()
     sys.stderr = StdErr()
@@ -85,4 +230,4 @@ def register():
         builtins.input = modified_input
     except BaseException as e:
         sys.__stderr__.write(repr(e) + "\n")
-        sys.__stderr__.flush()
\ No newline at end of file
+        sys.__stderr__.flush()
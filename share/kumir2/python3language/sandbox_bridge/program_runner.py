@@ -0,0 +1,381 @@
+"""
+Runs user program in bridge process rather than in IDE process.
+
+Program runs in a separate thread controlled by 'run_control' messages,
+reports pauses and finish by 'program_*' messages. Standard output is
+written to memory mapped ring buffer shared with IDE, which is notified
+by 'program_output' message only when it has read everything before.
+"""
+
+import builtins
+import ctypes
+import json
+import mmap
+import struct
+import sys
+import threading
+import time
+import types
+
+
+cout = sys.__stdout__
+
+# Ring header: total bytes written, total bytes read, notification flag
+RING_HEADER = struct.Struct("<QQQ")
+RING_DATA_OFFSET = 64
+
+
+def send(message):
+    cout.write(json.dumps(message, separators=(',', ':')) + "\n")
+    cout.flush()
+
+
+class Terminated(BaseException):
+    pass
+
+
+class OutputRing:
+    def __init__(self, path):
+        self.file = open(path, "r+b")
+        self.map = mmap.mmap(self.file.fileno(), 0)
+        self.capacity = len(self.map) - RING_DATA_OFFSET
+        self.lock = threading.Lock()
+
+    def write(self, text):
+        data = text.encode("utf-8")
+        with self.lock:
+            while data:
+                written, read, notified = RING_HEADER.unpack_from(self.map, 0)
+                free = self.capacity - (written - read)
+                if free == 0:
+                    # IDE is not fast enough, so wait for it to read
+                    self._notify()
+                    time.sleep(0.001)
+                    continue
+                chunk = data[:free]
+                pos = written % self.capacity
+                first = min(len(chunk), self.capacity - pos)
+                start = RING_DATA_OFFSET + pos
+                self.map[start:start + first] = chunk[:first]
+                if first < len(chunk):
+                    rest = len(chunk) - first
+                    self.map[RING_DATA_OFFSET:RING_DATA_OFFSET + rest] = chunk[first:]
+                # Data is written before position to be read by IDE
+                struct.pack_into("<Q", self.map, 0, written + len(chunk))
+                data = data[len(chunk):]
+                self._notify()
+
+    def _notify(self):
+        notified = struct.unpack_from("<Q", self.map, 16)[0]
+        if not notified:
+            struct.pack_into("<Q", self.map, 16, 1)
+            send({"type": "program_output"})
+
+    def close(self):
+        self.map.close()
+        self.file.close()
+
+
+class RingStdOut:
+    def __init__(self, ring):
+        self.ring = ring
+
+    def write(self, text):
+        self.ring.write(text)
+        return len(text)
+
+    def flush(self):
+        pass
+
+
+class KumirModule(types.ModuleType):
+    """Replacement of _kumir module provided by IDE for in-process runs"""
+
+    def __init__(self, runner):
+        super().__init__("_kumir")
+        self.runner = runner
+        self.input = []
+        self.forced = {}
+        self.test_runs_left = 1
+
+    def debug(self, message):
+        pass
+
+    def write_output(self, text):
+        sys.stdout.write(text)
+        return len(text)
+
+    def write_error(self, text):
+        sys.stderr.write(text)
+        return len(text)
+
+    def read_input(self):
+        if self.input:
+            return self.input.pop(0) + "\n"
+        return sys.stdin.readline() + "\n"
+
+    def actor_call(self, module_id, function_id, args):
+        return self.runner.actor_call(module_id, function_id, args)
+
+    def simulate_input(self, *values):
+        self.input += [str(value) for value in values]
+
+    def force_global_variable_value(self, name, value):
+        self.forced[name] = value
+
+    def get_output_buffer(self):
+        return ""
+
+    def set_permanent_value(self, name, value):
+        pass
+
+    def get_permanent_value(self, name, default=None):
+        return default
+
+    def del_permanent_value(self, name):
+        pass
+
+    def set_test_run_count(self, count):
+        self.test_runs_left = count
+
+    def set_parallel_test_runs(self, value):
+        pass
+
+    def get_test_runs_left(self):
+        return self.test_runs_left
+
+
+class ProgramRunner:
+    def __init__(self):
+        self.condition = threading.Condition()
+        self.thread = None
+        self.mode = "blind"
+        self.paused = False
+        self.breakpoints = set()
+        self.program_path = ""
+        self.depth = 0
+        self.target_depth = 0
+        self.steps = 0
+        self.line = -1
+        self.actor_result = None
+        self.actor_event = threading.Event()
+        self.kumir = KumirModule(self)
+
+    def start(self, message):
+        self.mode = message["mode"]
+        self.program_path = message["program_path"] or "<program>"
+        self.breakpoints = set((f, l) for f, l in message["breakpoints"])
+        self.depth = 0
+        self.target_depth = 1  # module level
+        self.steps = 0
+        self.line = -1
+        self.kumir.input = []
+        self.kumir.forced = {}
+        self.kumir.test_runs_left = 1
+        self.thread = threading.Thread(target=self._run, args=(message,), daemon=True)
+        self.thread.start()
+
+    def control(self, mode):
+        with self.condition:
+            self.mode = mode
+            self.target_depth = self.depth
+            self.paused = False
+            self.condition.notify_all()
+
+    def set_breakpoints(self, breakpoints):
+        with self.condition:
+            self.breakpoints = set((f, l) for f, l in breakpoints)
+
+    def terminate(self):
+        thread = self.thread
+        if thread is None or not thread.is_alive():
+            return
+        # Works for untraced programs too, unless blocked in C call or
+        # caught by program, then bridge process is killed by IDE
+        ctypes.pythonapi.PyThreadState_SetAsyncExc(
+            ctypes.c_ulong(thread.ident), ctypes.py_object(Terminated))
+        with self.condition:
+            self.paused = False
+            self.mode = "blind"
+            self.condition.notify_all()
+        self.actor_event.set()
+
+    def actor_return(self, error, value):
+        self.actor_result = (error, value)
+        self.actor_event.set()
+
+    def actor_call(self, module_id, function_id, args):
+        self.actor_event.clear()
+        send({"type": "program_actor_call", "module_id": module_id,
+              "function_id": function_id, "arguments": list(args)})
+        self.actor_event.wait()
+        error, value = self.actor_result or ("", None)
+        if isinstance(value, list):
+            value = tuple(value)
+        return error, value
+
+    def _is_program(self, frame):
+        return frame.f_code.co_filename == self.program_path
+
+    def _trace_call(self, frame, event, arg):
+        if not self._is_program(frame):
+            return None
+        self.depth += 1
+        return self._trace_local
+
+    def _trace_local(self, frame, event, arg):
+        if "line" == event:
+            self.steps += 1
+            self.line = frame.f_lineno - 1
+            if self.kumir.forced:
+                frame.f_globals.update(self.kumir.forced)
+            if self._must_stop(frame):
+                self._pause(frame)
+        elif "return" == event:
+            self.depth -= 1
+        return self._trace_local
+
+    def _must_stop(self, frame):
+        mode = self.mode
+        if "step_in" == mode:
+            return True
+        if "step_over" == mode and self.depth <= self.target_depth:
+            return True
+        if "step_out" == mode and self.depth < self.target_depth:
+            return True
+        if "blind" != mode:
+            return (self.program_path, self.line) in self.breakpoints
+        return False
+
+    def _pause(self, frame):
+        with self.condition:
+            self.paused = True
+            send({
+                "type": "program_paused",
+                "line": self.line,
+                "steps": self.steps,
+                "can_step_out": self.depth > 1,
+                "globals": self._representation(frame.f_globals),
+                "frames": self._frames(frame),
+            })
+            while self.paused:
+                self.condition.wait()
+
+    def _frames(self, frame):
+        # Locals of program functions, topmost frame first
+        result = []
+        while frame:
+            if self._is_program(frame) and frame.f_locals is not frame.f_globals:
+                result.append([frame.f_code.co_name, self._representation(frame.f_locals)])
+            frame = frame.f_back
+        return result
+
+    @staticmethod
+    def _representation(variables):
+        result = {}
+        for name, value in variables.items():
+            if name.startswith("__") or isinstance(value, (types.ModuleType, types.FunctionType, type)):
+                continue
+            try:
+                result[name] = repr(value)
+            except BaseException:
+                result[name] = "?"
+        return result
+
+    def _error_text(self, e):
+        tb = e.__traceback__
+        while tb:
+            if tb.tb_frame.f_code.co_filename == self.program_path:
+                self.line = tb.tb_lineno - 1
+            tb = tb.tb_next
+        return "{}: {}".format(type(e).__name__, e)
+
+    def _run(self, message):
+        ring = OutputRing(message["output_ring"])
+        saved_stdout = sys.stdout
+        sys.stdout = RingStdOut(ring)
+        sys.modules["_kumir"] = self.kumir
+        testing = message["testing"]
+        error = ""
+        mark = None
+        try:
+            for name, source in message["modules"]:
+                module = types.ModuleType(name)
+                exec(compile(source, "<generated>", "exec"), module.__dict__)
+                sys.modules[name] = module
+            program = compile(message["program"], self.program_path, "exec")
+            first_run = True
+            # Testing iterations as run in IDE: __pre_test__ before the
+            # first one, __post_test__ after the last one, and the mark
+            # is the least of __post_run__ marks unless __post_test__ sets it
+            while self.kumir.test_runs_left > 0:
+                globs = {"__name__": "__testing__" if testing else "__main__",
+                         "__builtins__": builtins}
+                self.kumir.input = []
+                self.kumir.forced = {}
+                if testing and first_run and message["pre_test"]:
+                    exec(compile(message["pre_test"], "<hidden>", "exec"), globs)
+                    globs["__pre_test__"]()
+                if testing and message["pre_run"]:
+                    exec(compile(message["pre_run"], "<hidden>", "exec"), globs)
+                    globs["__pre_run__"]()
+                # Breakpoints are not checked while running blind
+                traced = "blind" != self.mode or self.kumir.forced
+                if traced:
+                    sys.settrace(self._trace_call)
+                # Error is of the last iteration, but marks are still
+                # taken after failed ones
+                error = ""
+                try:
+                    exec(program, globs)
+                except Terminated:
+                    raise
+                except BaseException as e:
+                    error = self._error_text(e)
+                finally:
+                    sys.settrace(None)
+                if testing and message["post_run"]:
+                    exec(compile(message["post_run"], "<hidden>", "exec"), globs)
+                    result = globs["__post_run__"]()
+                    if isinstance(result, int):
+                        mark = result if first_run or mark is None else min(mark, result)
+                if testing and message["post_test"] and 1 == self.kumir.test_runs_left:
+                    exec(compile(message["post_test"], "<hidden>", "exec"), globs)
+                    result = globs["__post_test__"]()
+                    if isinstance(result, int):
+                        mark = result
+                self.kumir.test_runs_left -= 1
+                first_run = False
+        except Terminated:
+            error = "terminated"
+        except BaseException as e:
+            error = self._error_text(e)
+        finally:
+            sys.stdout = saved_stdout
+            ring.close()
+        send({
+            "type": "program_finished",
+            "line": self.line,
+            "error": error,
+            "steps": self.steps,
+            "mark": mark,
+        })
+
+
+runner = ProgramRunner()
+
+
+def handle_message(cmd, message):
+    if "run_program" == cmd:
+        runner.start(message)
+    elif "run_control" == cmd:
+        runner.control(message["mode"])
+    elif "set_breakpoints" == cmd:
+        runner.set_breakpoints(message["breakpoints"])
+    elif "terminate_program" == cmd:
+        runner.terminate()
+    elif "actor_return" == cmd:
+        runner.actor_return(message["error"], message["return_value"])
+    else:
+        return False
+    return True
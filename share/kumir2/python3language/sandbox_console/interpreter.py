@@ -5,6 +5,7 @@ import json
 import builtins
 import sys
 import copy
+from sandbox_bridge import io_wrapper
 
 old_sys_exit = sys.exit
 
@@ -17,28 +18,36 @@ class ExitException(BaseException):
 class Interpreter(code.InteractiveInterpreter):
 
     existing_threads = {}
+    finished_threads = set()
 
-    def __init__(self):
+    def __init__(self, finished_callback=None):
         locls = {"reset": self.reset}
         super().__init__(locls)
+        self.finished_callback = finished_callback
 
     def runsource_separate_thread(self, async_id, eval_string):
-        thread = threading.Thread(target=self.r, args=(async_id, eval_string))
+        thread = threading.Thread(target=self.r, args=(async_id, eval_string), daemon=True)
         Interpreter.existing_threads[thread] = None
         thread.start()
 
     def r(self, async_id, eval_string):
-        sys.exit = self.exit
-        result = self.runsource(eval_string)
-        out_message = {
-            "type": "eval_return",
-            "async_id": async_id,
-            "more_lines_required": result
-        }
-        message_line = json.dumps(out_message, separators=(',', ':'))
-        sys.__stdout__.write(message_line)
-        sys.__stdout__.write("\n")
-        sys.__stdout__.flush()
+        try:
+            sys.exit = self.exit
+            result = self.runsource(eval_string)
+            io_wrapper.finish_output()
+            out_message = {
+                "type": "eval_return",
+                "async_id": async_id,
+                "more_lines_required": result
+            }
+            message_line = json.dumps(out_message, separators=(',', ':'))
+            sys.__stdout__.write(message_line)
+            sys.__stdout__.write("\n")
+            sys.__stdout__.flush()
+        finally:
+            Interpreter.finished_threads.add(threading.current_thread())
+            if self.finished_callback:
+                self.finished_callback()
 
     def reset(self):
         sys.stdout.write("Restarting python interpreter...\n")
@@ -70,6 +79,10 @@ class Interpreter(code.InteractiveInterpreter):
         keys_to_remove = []
         for thread in keys:
             assert isinstance(thread, threading.Thread)
+            if thread in Interpreter.finished_threads:
+                # Thread has reported completion, but might be still alive
+                thread.join()
+                Interpreter.finished_threads.discard(thread)
             if not thread.is_alive():
                 exit_code = Interpreter.existing_threads[thread]
                 keys_to_remove += [thread]
@@ -0,0 +1,265 @@
+"""
+Runs testing mode iterations in a separate process.
+
+Reads a job as one JSON line from stdin, runs requested iterations of
+__pre_run__, program and __post_run__, and writes results as one JSON
+line to stdout. The _kumir module is replaced by pure Python one, so
+iterations calling actors are reported as unsupported to be run by IDE.
+Run limits of IDE are applied to each iteration, and the first one
+exceeded is reported to stop testing.
+"""
+
+import builtins
+import json
+import os
+import sys
+import threading
+import time
+import types
+
+try:
+    import resource
+except ImportError:
+    resource = None  # memory is not limited on Windows
+
+# Address space is limited rather than Python allocations, so some
+# reserve is left for memory allocated outside Python allocators
+ADDRESS_SPACE_RESERVE_FACTOR = 2
+# Time is checked once per this number of trace events
+TIME_CHECK_INTERVAL = 1000
+
+
+class ActorsNotAvailable(BaseException):
+    pass
+
+
+class LimitExceeded(BaseException):
+    def __init__(self, limit):
+        super().__init__(limit)
+        self.limit = limit
+
+
+class Limits:
+    """Limits of one iteration in milliseconds, steps and bytes, zero means no limit"""
+
+    def __init__(self, limits):
+        self.steps = limits.get("steps", 0)
+        self.wall_time = limits.get("wall_time", 0) / 1000.0
+        self.cpu_time = limits.get("cpu_time", 0) / 1000.0
+        self.memory = limits.get("memory", 0)
+
+    def traced(self):
+        return self.steps or self.cpu_time
+
+    def make_trace(self, program_path, kumir):
+        steps = 0
+        countdown = TIME_CHECK_INTERVAL
+        cpu_start = time.process_time()
+
+        def trace(frame, event, arg):
+            nonlocal steps, countdown
+            if kumir.forced:
+                # Forced values are protected from change by program
+                frame.f_globals.update(kumir.forced)
+            if "line" == event and frame.f_code.co_filename == program_path:
+                steps += 1
+                if self.steps and steps > self.steps:
+                    raise LimitExceeded("steps")
+            countdown -= 1
+            if 0 == countdown:
+                countdown = TIME_CHECK_INTERVAL
+                if self.cpu_time and time.process_time() - cpu_start >= self.cpu_time:
+                    raise LimitExceeded("cpu_time")
+            return trace
+
+        return trace
+
+    def apply_memory_limit(self):
+        # Added to address space already used by worker itself
+        if not self.memory or resource is None or not os.path.exists("/proc/self/statm"):
+            return
+        with open("/proc/self/statm") as statm:
+            used = int(statm.read().split()[0]) * resource.getpagesize()
+        limit = used + self.memory * ADDRESS_SPACE_RESERVE_FACTOR
+        resource.setrlimit(resource.RLIMIT_AS, (limit, limit))
+
+
+class Watchdog:
+    """Ends worker when iteration exceeds wall time, as program looping
+    on one line or blocked in C call is not stopped by trace function"""
+
+    def __init__(self, timeout, expire):
+        self.timeout = timeout
+        self.expire = expire
+        self.lock = threading.Lock()
+        self.timer = None
+
+    def start(self):
+        if not self.timeout:
+            return
+        with self.lock:
+            self.timer = threading.Timer(self.timeout, self._expire)
+            self.timer.args = (self.timer,)
+            self.timer.daemon = True
+            self.timer.start()
+
+    def stop(self):
+        with self.lock:
+            if self.timer is not None:
+                self.timer.cancel()
+                self.timer = None
+
+    def _expire(self, timer):
+        with self.lock:
+            # Iteration might be finished while waiting for lock
+            if timer is self.timer:
+                self.expire()
+
+
+class KumirModule(types.ModuleType):
+    def __init__(self, permanent):
+        super().__init__("_kumir")
+        self.permanent = permanent
+        self.runs_left = 1
+        self.output = []
+        self.errors = []
+        self.input = []
+        self.forced = {}
+
+    def reset(self, runs_left):
+        self.runs_left = runs_left
+        self.output = []
+        self.errors = []
+        self.input = []
+        self.forced = {}
+
+    def debug(self, message):
+        pass
+
+    def write_output(self, text):
+        self.output.append(text)
+        return len(text)
+
+    def write_error(self, text):
+        self.errors.append(text)
+        return len(text)
+
+    def read_input(self):
+        if self.input:
+            return self.input.pop(0) + "\n"
+        return ""
+
+    def actor_call(self, *args):
+        raise ActorsNotAvailable()
+
+    def get_output_buffer(self):
+        return "".join(self.output)
+
+    def simulate_input(self, *values):
+        self.input += [str(value) for value in values]
+
+    def force_global_variable_value(self, name, value):
+        self.forced[name] = value
+
+    def set_permanent_value(self, name, value):
+        self.permanent[name] = value
+
+    def get_permanent_value(self, name, default=None):
+        return self.permanent.get(name, default)
+
+    def del_permanent_value(self, name):
+        self.permanent.pop(name, None)
+
+    def set_test_run_count(self, count):
+        pass
+
+    def set_parallel_test_runs(self, value):
+        pass
+
+    def get_test_runs_left(self):
+        return self.runs_left
+
+
+def call_hook(globs, name):
+    if name in globs:
+        return globs[name]()
+    return None
+
+
+def run_iteration(job, kumir, limits, runs_left):
+    kumir.reset(runs_left)
+    globs = {"__name__": "__testing__", "__builtins__": builtins}
+    error = ""
+    mark = None
+    try:
+        if job["pre_run"]:
+            exec(compile(job["pre_run"], "<hidden>", "exec"), globs)
+            call_hook(globs, "__pre_run__")
+        program_path = job["program_path"] or "<program>"
+        program = compile(job["program"], program_path, "exec")
+        if kumir.forced or limits.traced():
+            globs.update(kumir.forced)
+            sys.settrace(limits.make_trace(program_path, kumir))
+        try:
+            exec(program, globs)
+        except (ActorsNotAvailable, LimitExceeded):
+            raise
+        except MemoryError as e:
+            if limits.memory:
+                raise LimitExceeded("memory")
+            error = str(e)
+        except BaseException as e:
+            error = str(e)
+        finally:
+            sys.settrace(None)
+        if job["post_run"]:
+            exec(compile(job["post_run"], "<hidden>", "exec"), globs)
+            result = call_hook(globs, "__post_run__")
+            if isinstance(result, int):
+                mark = result
+    except ActorsNotAvailable:
+        return {"unsupported": True}
+    except LimitExceeded as e:
+        return {"limit": e.limit}
+    return {"mark": mark, "error": error}
+
+
+def write_results(results, permanent):
+    out = {"results": results, "permanent": permanent}
+    sys.__stdout__.write(json.dumps(out) + "\n")
+    sys.__stdout__.flush()
+
+
+def main():
+    job = json.loads(sys.stdin.readline())
+    limits = Limits(job.get("limits", {}))
+    kumir = KumirModule(job["permanent"])
+    sys.modules["_kumir"] = kumir
+    import run_wrapper
+
+    for name, source in job["modules"]:
+        module = types.ModuleType(name)
+        exec(compile(source, "<generated>", "exec"), module.__dict__)
+        sys.modules[name] = module
+
+    limits.apply_memory_limit()
+    results = []
+
+    def expire():
+        write_results(results + [{"limit": "wall_time"}], kumir.permanent)
+        os._exit(0)
+
+    watchdog = Watchdog(limits.wall_time, expire)
+    for runs_left in job["runs_left"]:
+        watchdog.start()
+        result = run_iteration(job, kumir, limits, runs_left)
+        watchdog.stop()
+        results.append(result)
+        if result.get("unsupported") or result.get("limit"):
+            break
+
+    write_results(results, kumir.permanent)
+
+
+if __name__ == "__main__":
+    main()
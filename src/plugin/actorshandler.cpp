@@ -11,16 +11,6 @@ ActorsHandler::ActorsHandler(QObject *parent)
     initializeActors();
 }
 
-ActorsHandler* ActorsHandler::self = 0;
-
-ActorsHandler* ActorsHandler::instance(QObject *parent)
-{
-    if (!self) {
-        self = new ActorsHandler(parent);
-    }
-    return self;
-}
-
 void ActorsHandler::reset()
 {
     // Ensure semaphore value == 0
@@ -13,7 +13,7 @@ class ActorsHandler : public QObject
 {
     Q_OBJECT
 public:
-    static ActorsHandler* instance(QObject *parent = 0);
+    explicit ActorsHandler(QObject *parent = 0);
 
     QVariant call(int moduleId, int functionId, const QVariantList & arguments);
     void reset();
@@ -31,7 +31,6 @@ private /*types*/:
     typedef QPair<ActorInterface*, ActorInterface::RecordSpecification> TypeSpec;
 
 private /*methods*/:
-    explicit ActorsHandler(QObject *parent = 0);
     void initializeActors();
     void addActor(ActorInterface * actor);
 
@@ -62,7 +61,6 @@ private /*methods*/:
     static QString toPythonOperator(const QByteArray & asciiName);
 
 private /*fields*/:
-    static ActorsHandler* self;    
     QVector<QString> names_;
     QVector<QString> wrappers_;
     QVector<ActorInterface*> actors_;
@@ -15,17 +15,41 @@ PythonAnalizerInstance::PythonAnalizerInstance(Python3LanguagePlugin *parent,
     : QObject(parent)
     , _plugin(parent)
     , _py(interpreter)
+    , _usePep8(false)
     , _internalId(-1)
     , _tokenizer(new TokenizerInstance(this, _globalNames))
 {
-    QVariant id = _py->blockingCall("analyzer", "create", QVariantList());
-    _internalId = id.toLongLong();
+    // Interpreter process might be still starting, so requests
+    // are queued until it reports ready. Note that ready() is also
+    // emitted after process respawn, so analizer will be recreated
+    if (_py) {
+        connect(_py, SIGNAL(ready()), this, SLOT(handleInterpreterReady()));
+        if (_py->isReady()) {
+            handleInterpreterReady();
+        }
+    }
 }
 
 PythonAnalizerInstance::~PythonAnalizerInstance()
 {
-    if (_py) {
-        _py->blockingCall("analyzer", "remote", QVariantList() << _internalId);
+    if (remoteReady()) {
+        _py->blockingCall("analyzer", "remove", QVariantList() << _internalId);
+    }
+}
+
+void PythonAnalizerInstance::handleInterpreterReady()
+{
+    QVariant id = _py->blockingCall("analyzer", "create", QVariantList());
+    _internalId = id.toLongLong();
+    _py->blockingCall("analyzer", "set_use_pep8",
+                      QVariantList() << _usePep8);
+    if (!_sourceDirName.isEmpty()) {
+        _py->blockingCall("analyzer", "set_source_dir_name",
+                          QVariantList() << _internalId << _sourceDirName);
+    }
+    if (!_currentSourceText.isEmpty()) {
+        setSourceText(_currentSourceText);
+        Q_EMIT internallyReanalized();
     }
 }
 
@@ -38,18 +62,23 @@ Shared::AnalizerInterface * PythonAnalizerInstance::plugin()
 
 void PythonAnalizerInstance::setSourceDirName(const QString &path)
 {
-    _py->blockingCall("analyzer", "set_source_dir_name",
-                      QVariantList() << _internalId << path);
+    _sourceDirName = path;
+    if (remoteReady()) {
+        _py->blockingCall("analyzer", "set_source_dir_name",
+                          QVariantList() << _internalId << path);
+    }
 }
 
 void PythonAnalizerInstance::setSourceText(const QString &plainText)
 {
-    _py->blockingCall("analyzer", "set_source_text",
-                      QVariantList() << _internalId << plainText);
+    if (remoteReady()) {
+        _py->blockingCall("analyzer", "set_source_text",
+                          QVariantList() << _internalId << plainText);
 
-//    queryErrors();
-    queryNamesExtract();
-    querySyntaxHighlightHints();
+//        queryErrors();
+        queryNamesExtract();
+        querySyntaxHighlightHints();
+    }
     _currentSourceText = plainText;
     _tokenizer->setSourceText(plainText);
 }
@@ -211,6 +240,10 @@ LineProp PythonAnalizerInstance::lineProp(int lineNo, const QString &text) const
 
 void PythonAnalizerInstance::setUsePep8(bool use)
 {
+    _usePep8 = use;
+    if (!remoteReady()) {
+        return;  // Will be applied when interpreter becomes ready
+    }
     _py->blockingCall("analyzer", "set_use_pep8",
                       QVariantList() << use);
     setSourceText(_currentSourceText);  // Perform complete analisys again
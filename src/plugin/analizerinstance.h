@@ -39,6 +39,9 @@ public:
 Q_SIGNALS:
     void internallyReanalized();
 
+private Q_SLOTS:
+    void handleInterpreterReady();
+
 protected /*methods*/:
     explicit PythonAnalizerInstance(Python3LanguagePlugin *parent,
                                     PyInterpreterProcess* interpreter);
@@ -46,11 +49,14 @@ protected /*methods*/:
     void queryErrors();
     void queryNamesExtract();
     void querySyntaxHighlightHints();
+    inline bool remoteReady() const { return _py && _py->isReady() && -1 != _internalId; }
 
 private /*fields*/:    
     Python3LanguagePlugin* _plugin;
     PyInterpreterProcess* _py;
     QString _currentSourceText;
+    QString _sourceDirName;
+    bool _usePep8;
     QList<Error> _errors;
     long long _internalId;
     NamesContext _globalNames;
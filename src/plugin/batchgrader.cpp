@@ -0,0 +1,267 @@
+#include "batchgrader.h"
+#include "python3languageplugin.h"
+#include "pythonrunthread.h"
+
+#include <kumir2/analizer_sourcefileinterface.h>
+
+#ifdef Q_OS_LINUX
+#include <sys/resource.h>
+#include <unistd.h>
+#endif
+
+#include <iostream>
+
+namespace Python3Language {
+
+const int BatchGrader::WorkerKillDelay = 2000;
+const int BatchGrader::AddressSpaceReserveFactor = 2;
+
+BatchGrader::BatchGrader(Python3LanguagePlugin *plugin)
+    : QObject(plugin)
+    , _plugin(plugin)
+    , _jobsCount(QThread::idealThreadCount())
+    , _timeLimit(10000)
+    , _memoryLimit(0)
+    , _stdInBuffer(&_stdInData)
+    , _stdOut(&_stdOutData)
+    , _nextSubmission(0)
+    , _finishedCount(0)
+{
+}
+
+QString BatchGrader::start()
+{
+    const QFileInfo submissionsInfo(_submissionsPath);
+    if (submissionsInfo.isFile()) {
+        return gradeSubmission(submissionsInfo.absoluteFilePath());
+    }
+    else if (submissionsInfo.isDir()) {
+        const QDir submissionsDir(submissionsInfo.absoluteFilePath());
+        QStringList fileNames;
+        Q_FOREACH(const QString & name, submissionsDir.entryList(QStringList() << "*.py", QDir::Files, QDir::Name)) {
+            fileNames.append(submissionsDir.absoluteFilePath(name));
+        }
+        return gradeSubmissions(fileNames);
+    }
+    return tr("Submissions not found: %1").arg(_submissionsPath);
+}
+
+QString BatchGrader::gradeSubmission(const QString &fileName)
+{
+    // Submission text is to be checked by hidden text of task file
+    // rather than by hidden text of its own
+    QFile taskFile(_taskFileName);
+    QFile submissionFile(fileName);
+    if (!taskFile.open(QIODevice::ReadOnly)) {
+        return tr("Can't open task file: %1").arg(_taskFileName);
+    }
+    if (!submissionFile.open(QIODevice::ReadOnly)) {
+        return tr("Can't open submission file: %1").arg(fileName);
+    }
+    Shared::Analizer::SourceFileInterface * fileHandler = _plugin->sourceFileHandler();
+    const Shared::Analizer::SourceFileInterface::Data task = fileHandler->fromBytes(taskFile.readAll());
+    Shared::Analizer::SourceFileInterface::Data submission = fileHandler->fromBytes(submissionFile.readAll());
+    submission.hasHiddenText = task.hasHiddenText;
+    submission.hiddenText = task.hiddenText;
+    submission.hiddenTextSignature = task.hiddenTextSignature;
+
+    Shared::RunInterface::RunnableProgram program;
+    program.sourceFileName = fileName;
+    program.executableData = fileHandler->toBytes(submission);
+    _plugin->loadProgram(program);
+
+    // Program has no input and its output is not checked except
+    // by __post_run__, so keep it out of results output
+    _stdInBuffer.open(QIODevice::ReadOnly);
+    _stdIn.setDevice(&_stdInBuffer);
+    _plugin->setStdInTextStream(&_stdIn);
+    _plugin->setStdOutTextStream(&_stdOut);
+    connect(_plugin, SIGNAL(stopped(int)), this, SLOT(handleRunStopped(int)));
+
+    // Stopped here rather than killed by parent process
+    // to report steps and partial output
+    _plugin->setTestingLimits(0, _timeLimit, 0);
+    _plugin->setMemoryLimit(_memoryLimit);
+    applyMemoryLimit(_memoryLimit);
+    _elapsed.start();
+    _plugin->runTesting();
+    return QString();
+}
+
+void BatchGrader::handleRunStopped(int reason)
+{
+    QVariantMap result;
+    const QVariant mark = _plugin->valueStackTopItem();
+    const QString error = _plugin->error();
+    QString status = "ok";
+    if (Shared::RunInterface::SR_Done != reason || !error.isEmpty()) {
+        status = "error";
+    }
+    switch (_plugin->limitExceeded()) {
+    case StepsLimitExceeded: status = "step_limit"; break;
+    case WallTimeLimitExceeded: status = "time_limit"; break;
+    case CpuTimeLimitExceeded: status = "cpu_limit"; break;
+    case MemoryLimitExceeded: status = "memory_limit"; break;
+    default: break;
+    }
+    result["status"] = status;
+    result["mark"] = mark.isValid() ? mark : QVariant();
+    result["error"] = error;
+    result["steps"] = qulonglong(_plugin->stepsCounted());
+    result["peak_memory"] = _plugin->peakMemoryUsage();
+    result["time_ms"] = _elapsed.elapsed();
+
+    std::cout << QJsonDocument(QJsonObject::fromVariantMap(result)).toJson(QJsonDocument::Compact).constData() << std::endl;
+    QCoreApplication::exit(0);
+}
+
+QString BatchGrader::gradeSubmissions(const QStringList &fileNames)
+{
+    _submissions = fileNames;
+    _results.clear();
+    for (int i=0; i<_submissions.size(); i++) {
+        _results.append(QVariantMap());
+    }
+    _nextSubmission = 0;
+    _finishedCount = 0;
+    if (_submissions.isEmpty()) {
+        writeResults();
+        QCoreApplication::exit(0);
+        return QString();
+    }
+    for (int i=0; i<qMax(1, _jobsCount); i++) {
+        _workers.append(Worker());
+    }
+    startWorkers();
+    return QString();
+}
+
+void BatchGrader::startWorkers()
+{
+    // Each child process is the same program with the same configuration,
+    // but given single submission file rather than directory
+    for (int i=0; i<_workers.size() && _nextSubmission<_submissions.size(); i++) {
+        Worker & worker = _workers[i];
+        if (worker.process) {
+            continue;
+        }
+        worker.index = _nextSubmission ++;
+        worker.timedOut = false;
+        worker.process = new QProcess(this);
+        worker.process->setProcessChannelMode(QProcess::SeparateChannels);
+        worker.process->setProperty("workerIndex", i);
+        connect(worker.process, SIGNAL(finished(int,QProcess::ExitStatus)),
+                this, SLOT(handleWorkerFinished()));
+        worker.timer = new QTimer(this);
+        worker.timer->setSingleShot(true);
+        worker.timer->setProperty("workerIndex", i);
+        connect(worker.timer, SIGNAL(timeout()), this, SLOT(handleWorkerTimeout()));
+        QStringList arguments;
+        arguments << QString("--time-limit=%1").arg(_timeLimit)
+                  << QString("--memory-limit=%1").arg(_memoryLimit)
+                  << _taskFileName
+                  << _submissions[worker.index];
+        worker.process->start(QCoreApplication::applicationFilePath(), arguments);
+        // Child process stops itself at time limit, unless stuck
+        worker.timer->start(_timeLimit + WorkerKillDelay);
+    }
+}
+
+void BatchGrader::handleWorkerTimeout()
+{
+    Worker & worker = _workers[sender()->property("workerIndex").toInt()];
+    if (worker.process) {
+        worker.timedOut = true;
+        worker.process->kill();
+    }
+}
+
+void BatchGrader::handleWorkerFinished()
+{
+    finishWorker(sender()->property("workerIndex").toInt());
+    if (_finishedCount == _submissions.size()) {
+        writeResults();
+        QCoreApplication::exit(0);
+    }
+    else {
+        startWorkers();
+    }
+}
+
+void BatchGrader::finishWorker(int workerIndex)
+{
+    Worker & worker = _workers[workerIndex];
+    QVariantMap result;
+    if (worker.timedOut) {
+        result["status"] = "time_limit";
+        result["time_ms"] = _timeLimit;
+    }
+    else {
+        // Result is the last line of output, the rest is debug output
+        const QList<QByteArray> lines = worker.process->readAllStandardOutput().trimmed().split('\n');
+        result = QJsonDocument::fromJson(lines.last()).object().toVariantMap();
+        if (result.isEmpty()) {
+            result["status"] = "crashed";
+            result["error"] = QString::fromLocal8Bit(worker.process->readAllStandardError()).right(1024);
+        }
+    }
+    result["submission"] = QFileInfo(_submissions[worker.index]).fileName();
+    _results[worker.index] = result;
+    _finishedCount ++;
+
+    worker.timer->stop();
+    worker.timer->deleteLater();
+    worker.process->deleteLater();
+    worker.timer = 0;
+    worker.process = 0;
+}
+
+void BatchGrader::writeResults()
+{
+    QVariantList results;
+    Q_FOREACH(const QVariantMap & result, _results) {
+        results.append(result);
+    }
+    QVariantMap out;
+    out["task"] = QFileInfo(_taskFileName).fileName();
+    out["results"] = results;
+    const QByteArray data = QJsonDocument(QJsonObject::fromVariantMap(out)).toJson();
+
+    if (_resultsFileName.isEmpty()) {
+        std::cout << data.constData() << std::flush;
+        return;
+    }
+    QSaveFile resultsFile(_resultsFileName);
+    if (resultsFile.open(QIODevice::WriteOnly)) {
+        resultsFile.write(data);
+        resultsFile.commit();
+    }
+    else {
+        std::cerr << "Can't write results file: " << _resultsFileName.toLocal8Bit().constData() << std::endl;
+    }
+}
+
+void BatchGrader::applyMemoryLimit(int megabytes)
+{
+    // Program allocations are limited by plugin itself, so address space
+    // limit is just a safety net for memory allocated outside Python
+    // allocators, added to address space already used by this process
+    if (megabytes <= 0) {
+        return;
+    }
+#ifdef Q_OS_LINUX
+    QFile statm("/proc/self/statm");
+    if (!statm.open(QIODevice::ReadOnly)) {
+        return;
+    }
+    const quint64 usedPages = statm.readAll().split(' ').first().toULongLong();
+    struct rlimit limit;
+    limit.rlim_cur = limit.rlim_max = rlim_t(usedPages) * getpagesize()
+            + rlim_t(megabytes) * 1024 * 1024 * AddressSpaceReserveFactor;
+    if (0 != setrlimit(RLIMIT_AS, &limit)) {
+        qDebug() << "Can't set address space limit";
+    }
+#endif
+}
+
+} // namespace Python3Language
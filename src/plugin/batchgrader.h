@@ -0,0 +1,82 @@
+#ifndef PYTHON3LANGUAGE_BATCHGRADER_H
+#define PYTHON3LANGUAGE_BATCHGRADER_H
+
+#include <QtCore>
+
+namespace Python3Language {
+
+class Python3LanguagePlugin;
+
+// Grades student submissions without GUI using hidden __pre_run__ and
+// __post_run__ text of task file. Directory of submissions is graded by
+// pool of child processes running this program for one submission each,
+// so time and memory limits are applied per submission
+class BatchGrader : public QObject
+{
+    Q_OBJECT
+public /*methods*/:
+    explicit BatchGrader(Python3LanguagePlugin * plugin);
+
+    inline void setTaskFileName(const QString & fileName) { _taskFileName = fileName; }
+    inline void setSubmissionsPath(const QString & path) { _submissionsPath = path; }
+    inline void setResultsFileName(const QString & fileName) { _resultsFileName = fileName; }
+    inline void setJobsCount(int count) { _jobsCount = count; }
+    inline void setTimeLimit(int msec) { _timeLimit = msec; }
+    inline void setMemoryLimit(int megabytes) { _memoryLimit = megabytes; }
+
+    // Returns error text or empty string on success
+    QString start();
+
+private Q_SLOTS:
+    void handleRunStopped(int reason);
+    void handleWorkerFinished();
+    void handleWorkerTimeout();
+
+private /*types*/:
+    struct Worker {
+        QProcess * process;
+        QTimer * timer;
+        int index;
+        bool timedOut;
+        inline explicit Worker(): process(0), timer(0), index(-1), timedOut(false) {}
+    };
+
+private /*methods*/:
+    QString gradeSubmission(const QString & fileName);
+    QString gradeSubmissions(const QStringList & fileNames);
+    void startWorkers();
+    void finishWorker(int workerIndex);
+    void writeResults();
+    static void applyMemoryLimit(int megabytes);
+
+    static const int WorkerKillDelay;
+    static const int AddressSpaceReserveFactor;
+
+private /*fields*/:
+    Python3LanguagePlugin * _plugin;
+    QString _taskFileName;
+    QString _submissionsPath;
+    QString _resultsFileName;
+    int _jobsCount;
+    int _timeLimit;
+    int _memoryLimit;
+
+    // Single submission mode
+    QByteArray _stdInData;
+    QBuffer _stdInBuffer;
+    QTextStream _stdIn;
+    QString _stdOutData;
+    QTextStream _stdOut;
+    QElapsedTimer _elapsed;
+
+    // Pool mode
+    QStringList _submissions;
+    QList<QVariantMap> _results;
+    QList<Worker> _workers;
+    int _nextSubmission;
+    int _finishedCount;
+};
+
+} // namespace Python3Language
+
+#endif // PYTHON3LANGUAGE_BATCHGRADER_H
@@ -0,0 +1,554 @@
+#include "executionrecording.h"
+
+namespace Python3Language {
+
+// Record layout: payload length, payload, the same length again, so
+// records are walked in both directions. Payload is line number, frame
+// depth, changes count, then changes: kind, name id, flags and values
+const int ExecutionRecording::LengthSize = 4;
+const int ExecutionRecording::MaxReprLength = 200;
+const int ExecutionRecording::MaxContainerItems = 16;
+const int ExecutionRecording::MaxContainerLevel = 2;
+
+ExecutionRecording::ExecutionRecording()
+    : _head(0)
+    , _tail(0)
+    , _position(0)
+    , _recordsCount(0)
+    , _index(-1)
+    , _generation(0)
+    , _lineNumber(-1)
+    , _depth(0)
+{
+}
+
+ExecutionRecording::~ExecutionRecording()
+{
+    // Python objects must be released by finish while lock held
+    Q_ASSERT(_nameIds.isEmpty());
+    Q_ASSERT(_seenGlobals.isEmpty());
+}
+
+void ExecutionRecording::start(int memoryLimit)
+{
+    releaseObjects();
+    if (_ring.size() != memoryLimit) {
+        _ring = QByteArray();
+        _ring.resize(memoryLimit);
+    }
+    _head = _tail = _position = 0;
+    _recordsCount = 0;
+    _index = -1;
+    _nameIdsByText.clear();
+    _names.clear();
+    _generation = 0;
+    _globals.clear();
+    _locals.clear();
+    _functions.clear();
+    _lineNumber = -1;
+    _depth = 0;
+}
+
+void ExecutionRecording::finish()
+{
+    // Replay does not need Python objects, so they are released before
+    // interpreter ends, but values shown are kept
+    releaseObjects();
+}
+
+void ExecutionRecording::releaseObjects()
+{
+    QList<PyObject*> objects;
+    objects.swap(_released);
+    for (QHash<PyObject*,int>::const_iterator it=_nameIds.constBegin(); it!=_nameIds.constEnd(); ++it) {
+        objects.append(it.key());
+    }
+    _nameIds.clear();
+    Q_FOREACH(const SeenValue & value, _seenGlobals) {
+        objects.append(value.object);
+    }
+    _seenGlobals.clear();
+    for (int i=0; i<_seenLocals.size(); i++) {
+        Q_FOREACH(const SeenValue & value, _seenLocals[i]) {
+            objects.append(value.object);
+        }
+    }
+    _seenLocals.clear();
+    Q_FOREACH(PyCodeObject * code, _seenFunctions) {
+        objects.append(reinterpret_cast<PyObject*>(code));
+    }
+    _seenFunctions.clear();
+    Q_FOREACH(PyObject * object, objects) {
+        Py_XDECREF(object);
+    }
+}
+
+void ExecutionRecording::recordLine(PyFrameObject *frame, int lineNumber, int depth)
+{
+    if (_ring.isEmpty() || depth < 1) {
+        return;
+    }
+    // Program continues from the last recorded state, even if shown
+    // state was moved backward while paused
+    while (stepForward()) {}
+
+    if (_seenLocals.size() <= depth) {
+        _seenLocals.resize(depth + 1);
+        _seenFunctions.resize(depth + 1);
+        _locals.resize(depth + 1);
+        _functions.resize(depth + 1);
+    }
+
+    QByteArray changes;
+    int changesCount = 0;
+    PyObject * globals = frameGlobals(frame);
+    diffValues(globals, _seenGlobals, _globals, GlobalValue, changes, changesCount);
+
+    // Module level code has no locals other than globals
+    PyObject * locals = frameLocals(frame);
+    if (locals == globals) {
+        Py_DECREF(locals);
+        locals = 0;
+    }
+    else if (locals && !PyDict_Check(locals)) {
+        // Write through proxy since Python 3.13
+        PyObject * copy = PyDict_New();
+        if (0 != PyDict_Merge(copy, locals, 1)) {
+            PyErr_Clear();
+        }
+        Py_DECREF(locals);
+        locals = copy;
+    }
+    if (!locals) {
+        PyErr_Clear();
+    }
+
+    PyCodeObject * code = frameCode(frame);
+    if (code != _seenFunctions[depth]) {
+        const QString name = locals ? PyUnicodeToQString(code->co_name) : QString();
+        writeChange(changes, FunctionName, 0, &_functions[depth], &name);
+        changesCount ++;
+        _functions[depth] = name;
+        if (_seenFunctions[depth]) {
+            _released.append(reinterpret_cast<PyObject*>(_seenFunctions[depth]));
+        }
+        Py_INCREF(code);
+        _seenFunctions[depth] = code;
+    }
+    diffValues(locals, _seenLocals[depth], _locals[depth], LocalValue, changes, changesCount);
+    if (locals) {
+        _released.append(locals);
+    }
+
+    QByteArray payload;
+    payload.reserve(changes.size() + 16);
+    writeNumber(payload, quint32(lineNumber));
+    writeNumber(payload, quint32(depth));
+    writeNumber(payload, quint32(changesCount));
+    payload.append(changes);
+    append(payload);
+    _lineNumber = lineNumber;
+    _depth = depth;
+
+    // Objects released might run finalizers, so not while iterating
+    QList<PyObject*> released;
+    released.swap(_released);
+    Q_FOREACH(PyObject * object, released) {
+        Py_DECREF(object);
+    }
+}
+
+void ExecutionRecording::diffValues(PyObject *dict, SeenValues &seen, Values &state, ChangeKind kind, QByteArray &changes, int &changesCount)
+{
+    _generation ++;
+    if (dict) {
+        Py_ssize_t pos = 0;
+        PyObject * key = 0;
+        PyObject * value = 0;
+        while (PyDict_Next(dict, &pos, &key, &value)) {
+            const int id = nameId(key);
+            if (-1 == id) {
+                continue;
+            }
+            SeenValue & entry = seen[id];
+            const bool isNew = 0 == entry.object;
+            entry.generation = _generation;
+            // Values not changed in place keep their representation
+            if (!isNew && entry.object == value && !isContainer(value)) {
+                continue;
+            }
+            const QString repr = cheapRepr(value);
+            if (isNew || repr != entry.repr) {
+                writeChange(changes, kind, id, isNew ? 0 : &entry.repr, &repr);
+                changesCount ++;
+                state[id] = repr;
+                entry.repr = repr;
+            }
+            if (entry.object != value) {
+                if (entry.object) {
+                    _released.append(entry.object);
+                }
+                Py_INCREF(value);
+                entry.object = value;
+            }
+        }
+    }
+    for (SeenValues::iterator it=seen.begin(); it!=seen.end(); ) {
+        if (_generation == it.value().generation) {
+            ++it;
+            continue;
+        }
+        writeChange(changes, kind, it.key(), &it.value().repr, 0);
+        changesCount ++;
+        state.remove(it.key());
+        _released.append(it.value().object);
+        it = seen.erase(it);
+    }
+}
+
+int ExecutionRecording::nameId(PyObject *name)
+{
+    QHash<PyObject*,int>::const_iterator cached = _nameIds.constFind(name);
+    if (_nameIds.constEnd() != cached) {
+        return cached.value();
+    }
+    int id = -1;
+    if (PyUnicode_Check(name)) {
+        const QString text = PyUnicodeToQString(name);
+        if (!text.startsWith("_")) {
+            id = _nameIdsByText.value(text, -1);
+            if (-1 == id) {
+                id = _names.size();
+                _names.append(text);
+                _nameIdsByText[text] = id;
+            }
+        }
+    }
+    Py_INCREF(name);
+    _nameIds[name] = id;
+    return id;
+}
+
+void ExecutionRecording::append(const QByteArray &payload)
+{
+    const quint64 capacity = quint64(_ring.size());
+    const quint64 recordSize = quint64(payload.size()) + 2 * LengthSize;
+    if (recordSize > capacity) {
+        // Changes can't be undone past this record, so history is lost
+        _head = _tail = _position = 0;
+        _recordsCount = 0;
+        _index = -1;
+        return;
+    }
+    while (_tail + recordSize - _head > capacity) {
+        _head += readLength(_head) + 2 * LengthSize;
+        _recordsCount --;
+    }
+    const quint32 length = qToLittleEndian(quint32(payload.size()));
+    writeBytes(_tail, reinterpret_cast<const char*>(&length), LengthSize);
+    writeBytes(_tail + LengthSize, payload.constData(), payload.size());
+    writeBytes(_tail + LengthSize + payload.size(), reinterpret_cast<const char*>(&length), LengthSize);
+    _position = _tail;
+    _tail += recordSize;
+    _recordsCount ++;
+    _index = _recordsCount - 1;
+}
+
+bool ExecutionRecording::stepBack()
+{
+    // The oldest record is shown as is, since nothing was before
+    if (isEmpty() || _position == _head) {
+        return false;
+    }
+    apply(_position, true);
+    quint32 previousLength = 0;
+    readBytes(_position - LengthSize, reinterpret_cast<char*>(&previousLength), LengthSize);
+    _position -= qFromLittleEndian(previousLength) + 2 * LengthSize;
+    _index --;
+
+    const QByteArray payload = readPayload(_position);
+    int pos = 0;
+    _lineNumber = int(readNumber(payload, pos));
+    _depth = int(readNumber(payload, pos));
+    return true;
+}
+
+bool ExecutionRecording::stepForward()
+{
+    if (isEmpty()) {
+        return false;
+    }
+    const quint64 next = _position + readLength(_position) + 2 * LengthSize;
+    if (next == _tail) {
+        return false;
+    }
+    apply(next, false);
+    _position = next;
+    _index ++;
+    return true;
+}
+
+void ExecutionRecording::apply(quint64 position, bool undo)
+{
+    const QByteArray payload = readPayload(position);
+    int pos = 0;
+    const int lineNumber = int(readNumber(payload, pos));
+    const int depth = int(readNumber(payload, pos));
+    const int changesCount = int(readNumber(payload, pos));
+    if (_locals.size() <= depth) {
+        _locals.resize(depth + 1);
+        _functions.resize(depth + 1);
+    }
+    for (int i=0; i<changesCount; i++) {
+        const ChangeKind kind = ChangeKind(quint8(payload.at(pos++)));
+        const int id = int(readNumber(payload, pos));
+        const quint8 flags = quint8(payload.at(pos++));
+        const QString oldValue = flags & HasOldValue ? readString(payload, pos) : QString();
+        const QString newValue = flags & HasNewValue ? readString(payload, pos) : QString();
+        const bool hasValue = flags & (undo ? HasOldValue : HasNewValue);
+        const QString & value = undo ? oldValue : newValue;
+        if (FunctionName == kind) {
+            _functions[depth] = value;
+            continue;
+        }
+        Values & state = GlobalValue == kind ? _globals : _locals[depth];
+        if (hasValue) {
+            state[id] = value;
+        }
+        else {
+            state.remove(id);
+        }
+    }
+    if (!undo) {
+        _lineNumber = lineNumber;
+        _depth = depth;
+    }
+}
+
+ValueRepresentation ExecutionRecording::globals() const
+{
+    ValueRepresentation result;
+    for (Values::const_iterator it=_globals.constBegin(); it!=_globals.constEnd(); ++it) {
+        ValueRepresentation value;
+        value.name = _names.at(it.key());
+        value.repr = it.value();
+        result.children.append(value);
+    }
+    return result;
+}
+
+QList<ValueRepresentation> ExecutionRecording::locals() const
+{
+    // Topmost frame first, as variables model expects
+    QList<ValueRepresentation> result;
+    for (int depth=qMin(_depth, _locals.size()-1); depth>=1; depth--) {
+        if (_functions.at(depth).isEmpty()) {
+            continue;
+        }
+        ValueRepresentation frameLocals;
+        frameLocals.name = _functions.at(depth);
+        const Values & values = _locals.at(depth);
+        for (Values::const_iterator it=values.constBegin(); it!=values.constEnd(); ++it) {
+            ValueRepresentation value;
+            value.name = _names.at(it.key());
+            value.repr = it.value();
+            frameLocals.children.append(value);
+        }
+        result.append(frameLocals);
+    }
+    return result;
+}
+
+QByteArray ExecutionRecording::readPayload(quint64 position) const
+{
+    QByteArray payload(int(readLength(position)), Qt::Uninitialized);
+    readBytes(position + LengthSize, payload.data(), payload.size());
+    return payload;
+}
+
+quint32 ExecutionRecording::readLength(quint64 position) const
+{
+    quint32 length = 0;
+    readBytes(position, reinterpret_cast<char*>(&length), LengthSize);
+    return qFromLittleEndian(length);
+}
+
+void ExecutionRecording::readBytes(quint64 position, char *data, int size) const
+{
+    const int pos = int(position % quint64(_ring.size()));
+    const int first = qMin(size, _ring.size() - pos);
+    ::memcpy(data, _ring.constData() + pos, first);
+    ::memcpy(data + first, _ring.constData(), size - first);
+}
+
+void ExecutionRecording::writeBytes(quint64 position, const char *data, int size)
+{
+    const int pos = int(position % quint64(_ring.size()));
+    const int first = qMin(size, _ring.size() - pos);
+    char * ring = _ring.data();
+    ::memcpy(ring + pos, data, first);
+    ::memcpy(ring, data + first, size - first);
+}
+
+void ExecutionRecording::writeNumber(QByteArray &out, quint32 value)
+{
+    while (value >= 0x80) {
+        out.append(char(0x80 | (value & 0x7F)));
+        value >>= 7;
+    }
+    out.append(char(value));
+}
+
+quint32 ExecutionRecording::readNumber(const QByteArray &in, int &pos)
+{
+    quint32 value = 0;
+    for (int shift=0; pos<in.size(); shift+=7) {
+        const quint8 byte = quint8(in.at(pos++));
+        value |= quint32(byte & 0x7F) << shift;
+        if (0 == (byte & 0x80)) {
+            break;
+        }
+    }
+    return value;
+}
+
+void ExecutionRecording::writeString(QByteArray &out, const QString &value)
+{
+    const QByteArray utf8 = value.toUtf8();
+    writeNumber(out, quint32(utf8.size()));
+    out.append(utf8);
+}
+
+QString ExecutionRecording::readString(const QByteArray &in, int &pos)
+{
+    const int size = int(readNumber(in, pos));
+    const QString result = QString::fromUtf8(in.constData() + pos, size);
+    pos += size;
+    return result;
+}
+
+void ExecutionRecording::writeChange(QByteArray &out, ChangeKind kind, int nameId, const QString *oldValue, const QString *newValue)
+{
+    out.append(char(kind));
+    writeNumber(out, quint32(nameId));
+    out.append(char((oldValue ? HasOldValue : 0) | (newValue ? HasNewValue : 0)));
+    if (oldValue) {
+        writeString(out, *oldValue);
+    }
+    if (newValue) {
+        writeString(out, *newValue);
+    }
+}
+
+bool ExecutionRecording::isContainer(PyObject *object)
+{
+    return PyList_CheckExact(object) || PyTuple_CheckExact(object) ||
+            PyDict_CheckExact(object) || PySet_CheckExact(object) ||
+            PyFrozenSet_CheckExact(object);
+}
+
+QString ExecutionRecording::cheapRepr(PyObject *object, int level)
+{
+    // Representation is made on every change, so user defined __repr__
+    // is never called: only builtin values are shown by content
+    if (Py_None == object) {
+        return "None";
+    }
+    if (PyBool_Check(object) || PyLong_CheckExact(object) || PyFloat_CheckExact(object) ||
+            PyComplex_CheckExact(object) || PyUnicode_CheckExact(object) || PyBytes_CheckExact(object))
+    {
+        PyObject * shown = object;
+        bool truncated = false;
+        if (PyUnicode_CheckExact(object) && PyUnicode_GetLength(object) > MaxReprLength) {
+            shown = PyUnicode_Substring(object, 0, MaxReprLength);
+            truncated = true;
+        }
+        else if (PyBytes_CheckExact(object) && PyBytes_GET_SIZE(object) > MaxReprLength) {
+            shown = PyBytes_FromStringAndSize(PyBytes_AS_STRING(object), MaxReprLength);
+            truncated = true;
+        }
+        else {
+            Py_INCREF(shown);
+        }
+        PyObject * repr = shown ? PyObject_Repr(shown) : 0;
+        Py_XDECREF(shown);
+        if (!repr) {
+            // Too long integers can't be converted to string
+            PyErr_Clear();
+            return QString("<%1>").arg(Py_TYPE(object)->tp_name);
+        }
+        QString result = PyUnicodeToQString(repr);
+        Py_DECREF(repr);
+        if (truncated || result.length() > MaxReprLength) {
+            result = result.left(MaxReprLength) + "...";
+        }
+        return result;
+    }
+    if (isContainer(object)) {
+        const bool isList = PyList_CheckExact(object);
+        const bool isTuple = PyTuple_CheckExact(object);
+        const bool isDict = PyDict_CheckExact(object);
+        const Py_ssize_t size = isDict ? PyDict_Size(object) :
+                                isList ? PyList_GET_SIZE(object) :
+                                isTuple ? PyTuple_GET_SIZE(object) : PySet_GET_SIZE(object);
+        const QString opening = isList ? "[" : isTuple ? "(" : "{";
+        const QString closing = isList ? "]" : isTuple ? ")" : "}";
+        if (0 == size) {
+            return isDict || isList || isTuple ? opening + closing
+                                               : QString("%1()").arg(Py_TYPE(object)->tp_name);
+        }
+        if (level >= MaxContainerLevel) {
+            return opening + "..." + closing;
+        }
+        QStringList items;
+        if (isDict) {
+            Py_ssize_t pos = 0;
+            PyObject * key = 0;
+            PyObject * value = 0;
+            while (items.size() < MaxContainerItems && PyDict_Next(object, &pos, &key, &value)) {
+                items.append(cheapRepr(key, level + 1) + ": " + cheapRepr(value, level + 1));
+            }
+        }
+        else if (isList || isTuple) {
+            for (Py_ssize_t i=0; i<size && items.size()<MaxContainerItems; i++) {
+                PyObject * item = isList ? PyList_GET_ITEM(object, i) : PyTuple_GET_ITEM(object, i);
+                items.append(cheapRepr(item, level + 1));
+            }
+        }
+        else {
+            PyObject * iterator = PyObject_GetIter(object);
+            PyObject * item = 0;
+            while (iterator && items.size() < MaxContainerItems && (item = PyIter_Next(iterator))) {
+                items.append(cheapRepr(item, level + 1));
+                Py_DECREF(item);
+            }
+            Py_XDECREF(iterator);
+            PyErr_Clear();
+        }
+        if (size > items.size()) {
+            items.append("...");
+        }
+        QString result = opening + items.join(", ");
+        if (isTuple && 1 == size) {
+            result += ",";
+        }
+        return result + closing;
+    }
+    if (PyFunction_Check(object)) {
+        PyCodeObject * code = reinterpret_cast<PyCodeObject*>(PyFunction_GET_CODE(object));
+        return QString("<function %1>").arg(PyUnicodeToQString(code->co_name));
+    }
+    if (PyType_Check(object)) {
+        return QString("<class '%1'>").arg(reinterpret_cast<PyTypeObject*>(object)->tp_name);
+    }
+    if (PyModule_Check(object)) {
+        const char * name = PyModule_GetName(object);
+        if (!name) {
+            PyErr_Clear();
+        }
+        return QString("<module '%1'>").arg(name ? name : "?");
+    }
+    return QString("<%1 object>").arg(Py_TYPE(object)->tp_name);
+}
+
+} // namespace Python3Language
@@ -0,0 +1,99 @@
+#ifndef PYTHON3LANGUAGE_EXECUTIONRECORDING_H
+#define PYTHON3LANGUAGE_EXECUTIONRECORDING_H
+
+#include <QtCore>
+
+#include "pyutils.h"
+
+namespace Python3Language {
+
+// Log of executed program lines with changed variable values, to move
+// backward and forward through program history without running it
+// again. Records are kept in ring buffer of limited size, the oldest
+// ones are dropped. Each record keeps both old and new values, so state
+// of any kept record is reconstructed from the current one
+class ExecutionRecording
+{
+public /*methods*/:
+    explicit ExecutionRecording();
+    ~ExecutionRecording();
+
+    // Recording, by run thread while interpreter lock held
+    void start(int memoryLimit);
+    void recordLine(PyFrameObject * frame, int lineNumber, int depth);
+    void finish();
+
+    // Replay, while program is not running
+    inline bool isEmpty() const { return _head == _tail; }
+    inline int size() const { return _recordsCount; }
+    inline int position() const { return _index; }
+    inline int lineNumber() const { return _lineNumber; }
+    bool stepBack();
+    bool stepForward();
+    ValueRepresentation globals() const;
+    QList<ValueRepresentation> locals() const;
+
+private /*types*/:
+    enum ChangeKind { GlobalValue = 0, LocalValue = 1, FunctionName = 2 };
+    enum ChangeFlags { HasOldValue = 1, HasNewValue = 2 };
+    struct SeenValue {
+        PyObject * object;
+        QString repr;
+        quint32 generation;
+        inline explicit SeenValue(): object(0), generation(0) {}
+    };
+    typedef QHash<int,SeenValue> SeenValues;
+    typedef QHash<int,QString> Values;
+
+private /*methods*/:
+    int nameId(PyObject * name);
+    void diffValues(PyObject * dict, SeenValues & seen, Values & state, ChangeKind kind, QByteArray & changes, int & changesCount);
+    void append(const QByteArray & payload);
+    void apply(quint64 position, bool undo);
+    QByteArray readPayload(quint64 position) const;
+    void releaseObjects();
+    void readBytes(quint64 position, char * data, int size) const;
+    void writeBytes(quint64 position, const char * data, int size);
+    quint32 readLength(quint64 position) const;
+    static void writeNumber(QByteArray & out, quint32 value);
+    static quint32 readNumber(const QByteArray & in, int & pos);
+    static void writeString(QByteArray & out, const QString & value);
+    static QString readString(const QByteArray & in, int & pos);
+    static void writeChange(QByteArray & out, ChangeKind kind, int nameId, const QString * oldValue, const QString * newValue);
+    static QString cheapRepr(PyObject * object, int level = 0);
+    static bool isContainer(PyObject * object);
+
+    static const int LengthSize;
+    static const int MaxReprLength;
+    static const int MaxContainerItems;
+    static const int MaxContainerLevel;
+
+private /*fields*/:
+    QByteArray _ring;
+    quint64 _head;
+    quint64 _tail;
+    quint64 _position;
+    int _recordsCount;
+    int _index;
+
+    // Names are looked up by identity, so name objects are referenced
+    QHash<PyObject*,int> _nameIds;
+    QHash<QString,int> _nameIdsByText;
+    QVector<QString> _names;
+
+    // Values seen by recorder, and values shown at current position
+    SeenValues _seenGlobals;
+    QVector<SeenValues> _seenLocals;
+    QVector<PyCodeObject*> _seenFunctions;
+    quint32 _generation;
+    QList<PyObject*> _released;
+    Values _globals;
+    QVector<Values> _locals;
+    QVector<QString> _functions;
+    int _lineNumber;
+    int _depth;
+};
+
+} // namespace Python3Language
+
+#endif // PYTHON3LANGUAGE_EXECUTIONRECORDING_H
@@ -13,13 +13,18 @@ InterpreterCallback::InterpreterCallback(QObject *parent)
 {
 }
 
-InterpreterCallback* InterpreterCallback::self = 0;
+InterpreterCallback* InterpreterCallback::current()
+{
+    // Functions are called by program while interpreter lock held,
+    // so callback belongs to run thread of current interpreter
+    PythonRunThread * runThread = PythonRunThread::current();
+    return runThread ? runThread->callback() : 0;
+}
 
-InterpreterCallback* InterpreterCallback::instance(QObject * parent)
+PyObject* InterpreterCallback::noRunThreadError()
 {
-    if (!self)
-        self = new InterpreterCallback(parent);
-    return self;
+    PyErr_SetString(PyExc_RuntimeError, "program is not run by Kumir");
+    return 0;
 }
 
 PyObject* InterpreterCallback::__init__()
@@ -41,6 +46,7 @@ PyObject* InterpreterCallback::__init__()
 
         { "set_test_run_count", set_test_run_count, METH_VARARGS, "" },
         { "get_test_runs_left", get_test_runs_left, METH_VARARGS, "" },
+        { "set_parallel_test_runs", set_parallel_test_runs, METH_VARARGS, "Run test iterations in worker processes" },
         { 0, 0, 0, 0 }
     };
 
@@ -71,6 +77,10 @@ PyObject* InterpreterCallback::debug(PyObject *, PyObject *args)
 
 PyObject* InterpreterCallback::write_output(PyObject *, PyObject *args)
 {
+    InterpreterCallback * self = current();
+    if (!self) {
+        return noRunThreadError();
+    }
     PyObject * msg = PyTuple_GetItem(args, 0);
     QString message = PyUnicodeToQString(msg);
     self->mutex_->lock();
@@ -87,6 +97,10 @@ PyObject* InterpreterCallback::write_output(PyObject *, PyObject *args)
 
 PyObject* InterpreterCallback::write_error(PyObject *, PyObject *args)
 {
+    InterpreterCallback * self = current();
+    if (!self) {
+        return noRunThreadError();
+    }
     PyObject * msg = PyTuple_GetItem(args, 0);
     QString message = PyUnicodeToQString(msg);
     Q_EMIT self->errorMessageRequest(message);
@@ -95,6 +109,10 @@ PyObject* InterpreterCallback::write_error(PyObject *, PyObject *args)
 
 PyObject* InterpreterCallback::read_input(PyObject *, PyObject *)
 {
+    InterpreterCallback * self = current();
+    if (!self) {
+        return noRunThreadError();
+    }
     self->mutex_->lock();
     self->inputString_.clear();
     bool hasSimulatingInput = self->simulatingInputBuffer_.size() > 0;
@@ -124,6 +142,10 @@ PyObject* InterpreterCallback::read_input(PyObject *, PyObject *)
 
 PyObject* InterpreterCallback::get_output_buffer(PyObject *, PyObject *)
 {
+    InterpreterCallback * self = current();
+    if (!self) {
+        return noRunThreadError();
+    }
     self->mutex_->lock();
     PyObject* result = QStringToPyUnicode(self->outputBuffer_);
     self->mutex_->unlock();
@@ -133,6 +155,10 @@ PyObject* InterpreterCallback::get_output_buffer(PyObject *, PyObject *)
 
 PyObject* InterpreterCallback::simulate_input(PyObject *, PyObject *args)
 {
+    InterpreterCallback * self = current();
+    if (!self) {
+        return noRunThreadError();
+    }
     QMutexLocker l(self->mutex_);
     size_t count = PyTuple_Size(args);
     for (size_t i=0; i<count; i++) {
@@ -146,13 +172,17 @@ PyObject* InterpreterCallback::simulate_input(PyObject *, PyObject *args)
 
 PyObject* InterpreterCallback::actor_call(PyObject *, PyObject *args)
 {
+    PythonRunThread * runThread = PythonRunThread::current();
+    if (!runThread) {
+        return noRunThreadError();
+    }
     PyObject* pyModId = PyTuple_GetItem(args, 0);
     PyObject* pyFunId = PyTuple_GetItem(args, 1);
     PyObject* pyArgs = PyTuple_GetItem(args, 2);
     int modId = PyLong_AsLong(pyModId);
     int funId = PyLong_AsLong(pyFunId);
     const QVariantList funcArgs = PyObjectToQVariant(pyArgs).toList();
-    const QVariantList callResult = ActorsHandler::instance()->call(modId, funId, funcArgs).toList();
+    const QVariantList callResult = runThread->actorsHandler()->call(modId, funId, funcArgs).toList();
     PyObject* pyCallResult = PyTuple_New(2);
     const QString error = callResult.at(0).toString();
     PyObject* pyError = QStringToPyUnicode(error);
@@ -171,13 +201,17 @@ PyObject* InterpreterCallback::actor_call(PyObject *, PyObject *args)
 
 PyObject* InterpreterCallback::force_global_variable_value(PyObject *, PyObject *args)
 {
+    PythonRunThread * runThread = PythonRunThread::current();
+    if (!runThread) {
+        return noRunThreadError();
+    }
     if (PyTuple_Size(args)==2) {
         PyObject * pyName = PyTuple_GetItem(args, 0);
         PyObject * pyValue = PyTuple_GetItem(args, 1);
         if (PyUnicode_Check(pyName)) {
             Py_INCREF(pyValue);
             const QByteArray qName = PyUnicodeToQString(pyName).toLatin1();
-            PythonRunThread::instance()->forceGlobalVariableValue(qName, pyValue);
+            runThread->forceGlobalVariableValue(qName, pyValue);
         }
     }
     Py_RETURN_NONE;
@@ -185,6 +219,10 @@ PyObject* InterpreterCallback::force_global_variable_value(PyObject *, PyObject
 
 PyObject* InterpreterCallback::set_permanent_value(PyObject *, PyObject *args)
 {
+    InterpreterCallback * self = current();
+    if (!self) {
+        return noRunThreadError();
+    }
     if (PyTuple_Size(args)==2) {
         PyObject * pyName = PyTuple_GetItem(args, 0);
         PyObject * pyValue = PyTuple_GetItem(args, 1);
@@ -199,6 +237,10 @@ PyObject* InterpreterCallback::set_permanent_value(PyObject *, PyObject *args)
 
 PyObject* InterpreterCallback::get_permanent_value(PyObject *, PyObject *args)
 {
+    InterpreterCallback * self = current();
+    if (!self) {
+        return noRunThreadError();
+    }
     if (PyTuple_Size(args)>=1) {
         PyObject * pyName = PyTuple_GetItem(args, 0);
         if (PyUnicode_Check(pyName)) {
@@ -227,6 +269,10 @@ PyObject* InterpreterCallback::get_permanent_value(PyObject *, PyObject *args)
 
 PyObject* InterpreterCallback::del_permanent_value(PyObject *, PyObject *args)
 {
+    InterpreterCallback * self = current();
+    if (!self) {
+        return noRunThreadError();
+    }
     if (PyTuple_Size(args)>=1) {
         PyObject * pyName = PyTuple_GetItem(args, 0);
         if (PyUnicode_Check(pyName)) {
@@ -241,11 +287,15 @@ PyObject* InterpreterCallback::del_permanent_value(PyObject *, PyObject *args)
 
 PyObject* InterpreterCallback::set_test_run_count(PyObject *, PyObject *args)
 {
+    PythonRunThread * runThread = PythonRunThread::current();
+    if (!runThread) {
+        return noRunThreadError();
+    }
     if (PyTuple_Size(args)>=1) {
         PyObject * pyCount = PyTuple_GetItem(args, 0);
         if (PyLong_Check(pyCount)) {
             unsigned long count = PyLong_AsUnsignedLong(pyCount);
-            PythonRunThread::instance()->setTestRunCount(count);
+            runThread->setTestRunCount(count);
         }
     }
     Py_RETURN_NONE;
@@ -253,11 +303,28 @@ PyObject* InterpreterCallback::set_test_run_count(PyObject *, PyObject *args)
 
 PyObject* InterpreterCallback::get_test_runs_left(PyObject *, PyObject *)
 {
-    unsigned long left = PythonRunThread::instance()->testRunsLeft();
+    PythonRunThread * runThread = PythonRunThread::current();
+    if (!runThread) {
+        return noRunThreadError();
+    }
+    unsigned long left = runThread->testRunsLeft();
     PyObject * result = PyLong_FromUnsignedLong(left);
     Py_INCREF(result);
     return result;
 }
 
+PyObject* InterpreterCallback::set_parallel_test_runs(PyObject *, PyObject *args)
+{
+    PythonRunThread * runThread = PythonRunThread::current();
+    if (!runThread) {
+        return noRunThreadError();
+    }
+    if (PyTuple_Size(args)>=1) {
+        PyObject * pyValue = PyTuple_GetItem(args, 0);
+        runThread->setParallelTestRuns(PyObject_IsTrue(pyValue) > 0);
+    }
+    Py_RETURN_NONE;
+}
+
 
 } // namespace Python3Language
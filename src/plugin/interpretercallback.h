@@ -22,7 +22,7 @@ class InterpreterCallback : public QObject
 {
     Q_OBJECT
 public:
-    static InterpreterCallback * instance(QObject * parent = 0);
+    explicit InterpreterCallback(QObject *parent = 0);
 
     // Functions exported to python
     static PyObject* __init__();
@@ -39,6 +39,7 @@ public:
     static PyObject* del_permanent_value(PyObject*, PyObject *args);
     static PyObject* set_test_run_count(PyObject*, PyObject *args);
     static PyObject* get_test_runs_left(PyObject*, PyObject *);
+    static PyObject* set_parallel_test_runs(PyObject*, PyObject *args);
 
     inline void reset() {
         QMutexLocker l(mutex_);
@@ -49,6 +50,8 @@ public:
     inline void setInputString(const QString & text) { QMutexLocker l(mutex_); inputString_ = text; }
     inline void setStdInStream(QTextStream * stream) { QMutexLocker l(mutex_); overridenStdIn_ = stream; }
     inline void setStdOutStream(QTextStream * stream) { QMutexLocker l(mutex_); overridenStdOut_ = stream; }
+    inline QVariantMap permanentValues() const { QMutexLocker l(mutex_); return permanentStorage_; }
+    inline void setPermanentValues(const QVariantMap & values) { QMutexLocker l(mutex_); permanentStorage_ = values; }
 
 Q_SIGNALS:
     void outputMessageRequest(const QString & text);
@@ -56,10 +59,10 @@ Q_SIGNALS:
     void inputRequest();
 
 private /*methods*/:
-    explicit InterpreterCallback(QObject *parent = 0);
+    static InterpreterCallback * current();
+    static PyObject* noRunThreadError();
 
 private /*fields*/:
-    static InterpreterCallback * self;
     QMutex * mutex_;
     QString inputString_;
     QString outputBuffer_;
@@ -0,0 +1,405 @@
+#include "processrunner.h"
+#include "pyinterpreterprocess.h"
+#include "variablesmodel.h"
+#include "actorshandler.h"
+
+namespace Python3Language {
+
+// Ring layout shared with program_runner.py: little endian 64 bit total
+// bytes written, total bytes read and notification flag, then data
+const int ProcessRunner::OutputRingCapacity = 1024 * 1024;
+const int ProcessRunner::OutputRingDataOffset = 64;
+const int ProcessRunner::TerminateKillTimeout = 500;
+
+class ActorCallRunnable : public QRunnable
+{
+public:
+    inline explicit ActorCallRunnable(ProcessRunner * runner, ActorsHandler * handler,
+                                      int moduleId, int functionId, const QVariantList & arguments)
+        : runner_(runner), handler_(handler)
+        , moduleId_(moduleId), functionId_(functionId), arguments_(arguments) {}
+    inline void run() {
+        // Asynchronous actor methods block until synchronized by GUI
+        // thread, so they are not called from there
+        const QVariantList result = handler_->call(moduleId_, functionId_, arguments_).toList();
+        QMetaObject::invokeMethod(runner_, "sendActorReturn", Qt::QueuedConnection,
+                                  Q_ARG(QVariantList, result));
+    }
+private:
+    ProcessRunner * runner_;
+    ActorsHandler * handler_;
+    int moduleId_;
+    int functionId_;
+    QVariantList arguments_;
+};
+
+ProcessRunner::ProcessRunner(ActorsHandler *actorsHandler, QObject *parent)
+    : QObject(parent)
+    , _actorsHandler(actorsHandler)
+    , _process(0)
+    , _variablesModel(new VariablesModel(this))
+    , _outputRing(0)
+    , _outputDecoder(QTextCodec::codecForName("UTF-8")->makeDecoder())
+    , _killTimer(new QTimer(this))
+    , _running(false)
+    , _killed(false)
+    , _testingMode(false)
+    , _canStepOut(false)
+    , _runMode(RunInterface::RM_Idle)
+    , _lineNumber(-1)
+    , _stepsCounted(0)
+{
+    _killTimer->setSingleShot(true);
+    _killTimer->setInterval(TerminateKillTimeout);
+    connect(_killTimer, SIGNAL(timeout()), this, SLOT(killProgram()));
+}
+
+ProcessRunner::~ProcessRunner()
+{
+    if (_process) {
+        _process->kill();
+        _process->waitForFinished();
+    }
+    delete _outputDecoder;
+}
+
+QAbstractItemModel * ProcessRunner::variablesModel() const
+{
+    return _variablesModel;
+}
+
+void ProcessRunner::loadProgram(const QString &fileName, const QString &source,
+                                const QString &preRunSource, const QString &postRunSource,
+                                const QString &preTestSource, const QString &postTestSource)
+{
+    _programPath = fileName;
+    _programSource = source;
+    _preRunSource = preRunSource;
+    _postRunSource = postRunSource;
+    _preTestSource = preTestSource;
+    _postTestSource = postTestSource;
+    // Start process beforehand to save startup time on run
+    prepareProcess();
+}
+
+bool ProcessRunner::prepareProcess()
+{
+    if (_process && QProcess::NotRunning != _process->state()) {
+        return true;
+    }
+    if (_process) {
+        _process->deleteLater();
+    }
+    _process = PyInterpreterProcess::create(false, this);
+    if (!_process) {
+        return false;
+    }
+    connect(_process, SIGNAL(programMessageReceived(QVariantMap)),
+            this, SLOT(handleProgramMessage(QVariantMap)));
+    connect(_process, SIGNAL(inputRequiestReceived(QString)),
+            this, SLOT(handleInputRequest(QString)));
+    connect(_process, SIGNAL(stderrReceived(QString)),
+            this, SIGNAL(errorOutputRequest(QString)));
+    connect(_process, SIGNAL(finished(int,QProcess::ExitStatus)),
+            this, SLOT(handleProcessFinished()));
+
+    if (!_outputRing) {
+        if (!_outputRingFile.open() || !_outputRingFile.resize(OutputRingDataOffset + OutputRingCapacity)) {
+            qDebug() << "Can't create output ring file";
+            return false;
+        }
+        _outputRing = _outputRingFile.map(0, _outputRingFile.size());
+    }
+    return 0 != _outputRing;
+}
+
+void ProcessRunner::startOrContinue(const RunInterface::RunMode runMode)
+{
+    if (_running) {
+        _runMode = runMode;
+        QVariantMap message;
+        message["type"] = "run_control";
+        message["mode"] = runModeName(runMode);
+        _process->sendProgramMessage(message);
+        return;
+    }
+
+    if (!prepareProcess()) {
+        _errorText = tr("Can't start Python process");
+        Q_EMIT stopped(RunInterface::SR_Error);
+        return;
+    }
+    ::memset(_outputRing, 0, OutputRingDataOffset);
+    _errorText.clear();
+    _testingResult.clear();
+    _lineNumber = -1;
+    _stepsCounted = 0;
+    _canStepOut = false;
+    _running = true;
+    _killed = false;
+    // The first step over stops at the first line, as step into does
+    _runMode = RunInterface::RM_StepOver==runMode ? RunInterface::RM_StepIn : runMode;
+    _variablesModel->resetModel();
+    _actorsHandler->resetActors();
+
+    QVariantList modules;
+    for (int i=0; i<_actorsHandler->size(); i++) {
+        modules.append(QVariant(QVariantList() << _actorsHandler->moduleName(i) << _actorsHandler->moduleWrapper(i)));
+    }
+    QVariantList breakpoints;
+    Q_FOREACH(const BreakpointLocation & location, _breakpoints + _singleHits) {
+        breakpoints.append(QVariant(QVariantList() << location.first << location.second));
+    }
+    QVariantMap message;
+    message["type"] = "run_program";
+    message["program_path"] = _programPath;
+    message["program"] = _programSource;
+    message["pre_run"] = _preRunSource;
+    message["post_run"] = _postRunSource;
+    message["pre_test"] = _preTestSource;
+    message["post_test"] = _postTestSource;
+    message["testing"] = _testingMode;
+    message["mode"] = runModeName(_runMode);
+    message["breakpoints"] = breakpoints;
+    message["modules"] = modules;
+    message["output_ring"] = _outputRingFile.fileName();
+    _process->sendProgramMessage(message);
+    Q_EMIT updateStepsCounter(0);
+}
+
+void ProcessRunner::terminate()
+{
+    if (_running && _process) {
+        QVariantMap message;
+        message["type"] = "terminate_program";
+        _process->sendProgramMessage(message);
+        // Program might catch exception raised by bridge or be in long
+        // C call, so bridge process is killed unless stopped soon
+        if (!_killTimer->isActive()) {
+            _killTimer->start();
+        }
+    }
+}
+
+void ProcessRunner::killProgram()
+{
+    if (_running && _process) {
+        _killed = true;
+        _process->kill();
+    }
+}
+
+void ProcessRunner::setInputResult(const QVariantList &results)
+{
+    if (_process) {
+        _process->sendInput((results.isEmpty() ? QString() : results.at(0).toString()) + "\n");
+    }
+}
+
+void ProcessRunner::handleInputRequest(const QString &prompt)
+{
+    // Output written before input request must be shown first,
+    // then prompt, which is passed by request only
+    readOutputRing();
+    if (!prompt.isEmpty()) {
+        Q_EMIT outputRequest(prompt);
+    }
+    Q_EMIT inputRequest("s");
+}
+
+void ProcessRunner::handleProgramMessage(const QVariantMap &message)
+{
+    const QString type = message["type"].toString();
+    if ("program_output" == type) {
+        readOutputRing();
+    }
+    else if ("program_paused" == type) {
+        readOutputRing();
+        _lineNumber = message["line"].toInt();
+        _stepsCounted = message["steps"].toULongLong();
+        _canStepOut = message["can_step_out"].toBool();
+        _singleHits.clear();
+
+        ValueRepresentation globals;
+        const QVariantMap globalValues = message["globals"].toMap();
+        for (QVariantMap::const_iterator it=globalValues.constBegin(); it!=globalValues.constEnd(); ++it) {
+            ValueRepresentation value;
+            value.name = it.key();
+            value.repr = it.value().toString();
+            globals.children.append(value);
+        }
+        QList<ValueRepresentation> locals;
+        Q_FOREACH(const QVariant & frame, message["frames"].toList()) {
+            ValueRepresentation frameLocals;
+            frameLocals.name = frame.toList().value(0).toString();
+            const QVariantMap localValues = frame.toList().value(1).toMap();
+            for (QVariantMap::const_iterator it=localValues.constBegin(); it!=localValues.constEnd(); ++it) {
+                ValueRepresentation value;
+                value.name = it.key();
+                value.repr = it.value().toString();
+                frameLocals.children.append(value);
+            }
+            locals.append(frameLocals);
+        }
+        _variablesModel->update(globals, locals);
+
+        Q_EMIT updateStepsCounter(_stepsCounted);
+        Q_EMIT lineChanged(_lineNumber, 0, 0);
+        Q_EMIT stopped(RunInterface::SR_UserInteraction);
+    }
+    else if ("program_actor_call" == type) {
+        QThreadPool::globalInstance()->start(new ActorCallRunnable(
+                                                 this, _actorsHandler,
+                                                 message["module_id"].toInt(),
+                                                 message["function_id"].toInt(),
+                                                 message["arguments"].toList()
+                                                 ));
+    }
+    else if ("program_finished" == type) {
+        readOutputRing();
+        _lineNumber = message["line"].toInt();
+        _stepsCounted = message["steps"].toULongLong();
+        _errorText = message["error"].toString();
+        if (message["mark"].isValid() && !message["mark"].isNull()) {
+            _testingResult = message["mark"];
+        }
+        if ("terminated" == _errorText) {
+            _errorText.clear();
+            finish(RunInterface::SR_UserTerminated);
+        }
+        else {
+            finish(_errorText.isEmpty() ? RunInterface::SR_Done : RunInterface::SR_Error);
+        }
+    }
+}
+
+void ProcessRunner::sendActorReturn(const QVariantList &result)
+{
+    if (_process) {
+        QVariantMap message;
+        message["type"] = "actor_return";
+        message["error"] = result.value(0).toString();
+        message["return_value"] = result.value(1);
+        _process->sendProgramMessage(message);
+    }
+}
+
+void ProcessRunner::handleProcessFinished()
+{
+    // Crash of program does not affect IDE, but is reported as error
+    if (_running && _killed) {
+        readOutputRing();
+        finish(RunInterface::SR_UserTerminated);
+    }
+    else if (_running) {
+        readOutputRing();
+        _errorText = tr("Python process terminated unexpectedly");
+        finish(RunInterface::SR_Error);
+    }
+}
+
+void ProcessRunner::finish(RunInterface::StopReason reason)
+{
+    _running = false;
+    _killTimer->stop();
+    _testingMode = false;
+    _singleHits.clear();
+    Q_EMIT updateStepsCounter(_stepsCounted);
+    if (-1 != _lineNumber && RunInterface::SR_Error == reason) {
+        Q_EMIT lineChanged(_lineNumber, 0, 0);
+    }
+    Q_EMIT stopped(reason);
+}
+
+void ProcessRunner::readOutputRing()
+{
+    if (!_outputRing) {
+        return;
+    }
+    QAtomicInteger<quint64> * written = reinterpret_cast<QAtomicInteger<quint64>*>(_outputRing);
+    QAtomicInteger<quint64> * read = reinterpret_cast<QAtomicInteger<quint64>*>(_outputRing + 8);
+    QAtomicInteger<quint64> * notified = reinterpret_cast<QAtomicInteger<quint64>*>(_outputRing + 16);
+
+    // Flag is cleared before reading, so anything written after
+    // that is notified again
+    notified->fetchAndStoreOrdered(0);
+    quint64 end = qFromLittleEndian(written->loadAcquire());
+    quint64 begin = qFromLittleEndian(read->loadAcquire());
+    const char * data = reinterpret_cast<const char*>(_outputRing + OutputRingDataOffset);
+    QString output;
+    while (begin < end) {
+        const int pos = int(begin % OutputRingCapacity);
+        const int size = int(qMin(end - begin, quint64(OutputRingCapacity - pos)));
+        // Characters might be split between reads, so decoder keeps state
+        output += _outputDecoder->toUnicode(data + pos, size);
+        begin += size;
+        if (begin == end) {
+            // Writer might still see the flag set while it was cleared,
+            // so output written meanwhile is read without notification
+            read->storeRelease(qToLittleEndian(begin));
+            end = qFromLittleEndian(written->loadAcquire());
+        }
+    }
+    if (!output.isEmpty()) {
+        Q_EMIT outputRequest(output);
+    }
+}
+
+void ProcessRunner::sendBreakpoints()
+{
+    if (!_running || !_process) {
+        return;
+    }
+    QVariantList breakpoints;
+    Q_FOREACH(const BreakpointLocation & location, _breakpoints + _singleHits) {
+        breakpoints.append(QVariant(QVariantList() << location.first << location.second));
+    }
+    QVariantMap message;
+    message["type"] = "set_breakpoints";
+    message["breakpoints"] = breakpoints;
+    _process->sendProgramMessage(message);
+}
+
+void ProcessRunner::removeAllBreakpoints()
+{
+    _breakpoints.clear();
+    _singleHits.clear();
+    sendBreakpoints();
+}
+
+void ProcessRunner::insertSingleHitBreakpoint(const BreakpointLocation &location)
+{
+    _singleHits.insert(location);
+    sendBreakpoints();
+}
+
+void ProcessRunner::addOrChangeBreakpoint(const BreakpointLocation &location, const BreakpointData &data)
+{
+    // Conditions and ignore counts are not supported out of process
+    if (data.enabled) {
+        _breakpoints.insert(location);
+    }
+    else {
+        _breakpoints.remove(location);
+    }
+    sendBreakpoints();
+}
+
+void ProcessRunner::removeBreakpoint(const BreakpointLocation &location)
+{
+    _breakpoints.remove(location);
+    sendBreakpoints();
+}
+
+QString ProcessRunner::runModeName(RunInterface::RunMode mode)
+{
+    switch (mode) {
+    case RunInterface::RM_Regular: return "regular";
+    case RunInterface::RM_StepOver: return "step_over";
+    case RunInterface::RM_StepIn: return "step_in";
+    case RunInterface::RM_StepOut: return "step_out";
+    default: return "blind";
+    }
+}
+
+} // namespace Python3Language
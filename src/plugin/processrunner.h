@@ -0,0 +1,109 @@
+#ifndef PYTHON3LANGUAGE_PROCESSRUNNER_H
+#define PYTHON3LANGUAGE_PROCESSRUNNER_H
+
+#include <QtCore>
+#include <kumir2/runinterface.h>
+
+#include "pythonrunthread.h"
+
+namespace Python3Language {
+
+class PyInterpreterProcess;
+
+// Runs program in separate bridge process, so crash of program or
+// its CPU load does not affect IDE. Has the same interface as run
+// thread has for plugin. Program standard output is passed through
+// memory mapped ring buffer, everything else by bridge messages
+class ProcessRunner : public QObject
+{
+    Q_OBJECT
+public /*methods*/:
+    explicit ProcessRunner(ActorsHandler * actorsHandler, QObject * parent);
+    ~ProcessRunner();
+
+    inline QString errorText() const { return _errorText; }
+    inline QVariant testingResult() const { return _testingResult; }
+    inline int currentLineNumber() const { return _lineNumber; }
+    inline quint64 stepsCounted() const { return _stepsCounted; }
+    inline bool canStepOut() const { return _canStepOut; }
+    inline void setTestingMode(bool v) { _testingMode = v; }
+    inline bool isTestingMode() const { return _testingMode; }
+    inline bool isRunning() const { return _running; }
+    inline RunInterface::RunMode currentRunMode() const { return _running ? _runMode : RunInterface::RM_Idle; }
+    QAbstractItemModel * variablesModel() const;
+
+    void loadProgram(const QString & fileName,
+                     const QString & source,
+                     const QString & preRunSource,
+                     const QString & postRunSource,
+                     const QString & preTestSource,
+                     const QString & postTestSource);
+
+    void removeAllBreakpoints();
+    void insertSingleHitBreakpoint(const BreakpointLocation & location);
+    void addOrChangeBreakpoint(const BreakpointLocation & location, const BreakpointData & data);
+    void removeBreakpoint(const BreakpointLocation & location);
+
+Q_SIGNALS:
+    void errorOutputRequest(const QString &);
+    void outputRequest(const QString & output);
+    void inputRequest(const QString & format);
+    void stopped(int reason);
+    void updateStepsCounter(quint64);
+    void lineChanged(int lineNo, quint32 colStart, quint32 colEnd);
+
+public Q_SLOTS:
+    void startOrContinue(const Shared::RunInterface::RunMode runMode);
+    void terminate();
+    void setInputResult(const QVariantList & results);
+
+private Q_SLOTS:
+    void handleProgramMessage(const QVariantMap & message);
+    void handleInputRequest(const QString & prompt);
+    void handleProcessFinished();
+    void killProgram();
+    void sendActorReturn(const QVariantList & result);
+
+private /*methods*/:
+    bool prepareProcess();
+    void readOutputRing();
+    void sendBreakpoints();
+    void finish(RunInterface::StopReason reason);
+    static QString runModeName(RunInterface::RunMode mode);
+
+private /*fields*/:
+    ActorsHandler * _actorsHandler;
+    PyInterpreterProcess * _process;
+    VariablesModel * _variablesModel;
+    QTemporaryFile _outputRingFile;
+    uchar * _outputRing;
+    QTextDecoder * _outputDecoder;
+    QTimer * _killTimer;
+
+    QString _programPath;
+    QString _programSource;
+    QString _preRunSource;
+    QString _postRunSource;
+    QString _preTestSource;
+    QString _postTestSource;
+    QSet<BreakpointLocation> _breakpoints;
+    QSet<BreakpointLocation> _singleHits;
+
+    bool _running;
+    bool _killed;
+    bool _testingMode;
+    bool _canStepOut;
+    RunInterface::RunMode _runMode;
+    QString _errorText;
+    QVariant _testingResult;
+    int _lineNumber;
+    quint64 _stepsCounted;
+
+    static const int OutputRingCapacity;
+    static const int OutputRingDataOffset;
+    static const int TerminateKillTimeout;
+};
+
+} // namespace Python3Language
+
+#endif // PYTHON3LANGUAGE_PROCESSRUNNER_H
@@ -7,9 +7,13 @@
 #include <QJsonObject>
 #include <QJsonArray>
 #include <QThread>
+#include <QTimer>
+#include <QElapsedTimer>
 #include <QApplication>
 #include <QMessageBox>
 
+#include <cstring>
+
 #ifdef Q_OS_UNIX
 #   include <signal.h>
 #   include <unistd.h>
@@ -20,6 +24,14 @@
 
 namespace Python3Language {
 
+#ifndef Q_OS_WIN32
+const int PyInterpreterProcess::ActiveWaitTimeout = 10;
+#else
+const int PyInterpreterProcess::ActiveWaitTimeout = 50;
+#endif
+const int PyInterpreterProcess::ReceiveBufferReserve = 64 * 1024;
+const int PyInterpreterProcess::StartupTimeout = 20000;
+
 int PyInterpreterProcess::DebugPortNumberOffset = 0;
 qint64 PyInterpreterProcess::AsyncCallId = 0;
 
@@ -27,8 +39,8 @@ PyInterpreterProcess *PyInterpreterProcess::create(bool autoRespawn, QObject *pa
 {
     PyInterpreterProcess *result = new PyInterpreterProcess(autoRespawn, parent);
     if (result->launchProcess()) {
-        QVariant pythonCwd = result->blockingCall("os", "getcwd", QVariantList());
-        qDebug() << "Python working directory: " << pythonCwd.toString();
+        // Process is not ready until it responds to ping,
+        // see ready() signal
         return result;
     }
     else {
@@ -49,14 +61,28 @@ void PyInterpreterProcess::sendExit()
     DebugPortNumberOffset = qMax(0, DebugPortNumberOffset-1);
 }
 
-bool PyInterpreterProcess::waitForPong(int msec)
+bool PyInterpreterProcess::waitForReady(int msec)
 {
-    Message pong = waitForMessage(Message::Type::Pong, msec);
-    return Message::Type::Pong == pong.type;
+    QElapsedTimer timer;
+    timer.start();
+    while (!_ready && QProcess::ProcessState::NotRunning != state()) {
+        if (-1 != msec && timer.elapsed() >= msec) break;
+        const int quantum = -1 == msec
+                ? ActiveWaitTimeout
+                : qBound(0, msec - int(timer.elapsed()), ActiveWaitTimeout);
+        waitForIncomingData(quantum);
+    }
+    return _ready;
 }
 
 QVariant PyInterpreterProcess::blockingCall(const QByteArray &moduleName, const QByteArray &functionName, const QVariantList &arguments)
 {
+    // Interpreter which does not start in time is considered not running
+    if (!_ready && !waitForReady(StartupTimeout)) {
+        qDebug() << "Python subprocess is not running, call ignored: "
+                 << moduleName << "." << functionName;
+        return QVariant();
+    }
     sendMessage(Message(moduleName, functionName, arguments));
     Message response = waitForMessage(Message::Type::BlockingReturn, -1);
     return response.returnValue;
@@ -75,12 +101,35 @@ void PyInterpreterProcess::sendInput(const QString &data)
     sendMessage(Message(Message::Type::InputResponse, data));
 }
 
+void PyInterpreterProcess::setOutputLimits(int window, int tailLimit)
+{
+    _outputWindow = window;
+    _outputTailLimit = tailLimit;
+    sendMessage(Message(Message::Type::OutputControl,
+                        QVariantList() << window << tailLimit));
+}
+
 
 
+void PyInterpreterProcess::sendProgramMessage(const QVariantMap &message)
+{
+    sendMessage(Message(message));
+}
+
 PyInterpreterProcess::PyInterpreterProcess(bool autoRespawn, QObject * parent)
     : QProcess(parent)
+    , _receiveScanPos(0)
+    , _receiveFrameStart(0)
+    , _receiveNestingLevel(0)
+    , _pendingOutputType(Message::Type::None)
+    , _pendingOutputFlushScheduled(false)
     , _allowProcessRespawn(autoRespawn)
+    , _ready(false)
+    , _outputWindow(-1)
+    , _outputTailLimit(0)
 {
+    // Reserved capacity is kept while buffer is compacted
+    _receiveBuffer.reserve(ReceiveBufferReserve);
     QProcessEnvironment env = QProcessEnvironment::systemEnvironment();
     QString path = pythonExtraPath();
 #ifdef Q_OS_UNIX
@@ -113,17 +162,21 @@ PyInterpreterProcess::PyInterpreterProcess(bool autoRespawn, QObject * parent)
 
 bool PyInterpreterProcess::launchProcess()
 {
+    _ready = false;
     start(pythonExecutablePath(), {"-m", "sandbox_bridge"});
     waitForStarted();        
     if (QProcess::ProcessState::Running == state()) {
+        // Do not wait for interpreter startup here: the first pong
+        // marks process as ready, all the requests sent before are
+        // buffered by pipe and processed by interpreter after startup
         sendPing();
-        if (waitForPong(20000)) {
-            return true;
-        }
-        else {
-            qDebug() << "Python subprocess does not respond to ping request";
-            return false;
+        if (-1 != _outputWindow) {
+            // Restore limits after respawn
+            sendMessage(Message(Message::Type::OutputControl,
+                                QVariantList() << _outputWindow << _outputTailLimit));
         }
+        QTimer::singleShot(StartupTimeout, this, SLOT(handleStartupTimeout()));
+        return true;
     }
     else {
         qDebug() << "Error staring python process";
@@ -163,26 +216,38 @@ void PyInterpreterProcess::sendMessage(const Message &message)
         obj["type"] = "input_response";
         obj["data"] = message.stringData;
         break;
+    case Message::Type::OutputCredit:
+        obj["type"] = "output_credit";
+        obj["amount"] = message.arguments.value(0).toInt();
+        break;
+    case Message::Type::OutputControl:
+        obj["type"] = "output_control";
+        obj["window"] = message.arguments.value(0).toInt();
+        obj["tail_limit"] = message.arguments.value(1).toInt();
+        break;
+    case Message::Type::ProgramControl:
+        obj = QJsonObject::fromVariantMap(message.fields);
+        break;
+    default:
+        break;
     }
 
     const QByteArray raw = QJsonDocument(obj)
             .toJson(QJsonDocument::JsonFormat::Compact);
     write(raw + "\n");
-    waitForBytesWritten(5000);
+    // Credit is sent by GUI thread after each output flush, so it is
+    // not waited for, event loop writes it as soon as possible
+    if (Message::Type::OutputCredit != message.type) {
+        waitForBytesWritten(5000);
+    }
 }
 
 Message PyInterpreterProcess::waitForMessage(Message::Type waitType, int msec)
 {
-#ifndef Q_OS_WIN32
-    static const int ActiveWaitTimeout = 10;
-#else
-    static const int ActiveWaitTimeout = 50;
-#endif
     Message result;
-    int quantumNo = 1;
-    const int quantumCount = msec / ActiveWaitTimeout;
-    while (quantumNo <= quantumCount || -1==msec) {
-        if (Message::Type::None != result.type) break;
+    QElapsedTimer timer;
+    timer.start();
+    while (-1==msec || timer.elapsed() < msec) {
         _incomingMessagesMutex.lock();
         if (!_incomingMessages.isEmpty() &&
                 (waitType==_incomingMessages.head().type || Message::Type::Exception==_incomingMessages.head().type)
@@ -198,16 +263,31 @@ Message PyInterpreterProcess::waitForMessage(Message::Type waitType, int msec)
             }
         }
         _incomingMessagesMutex.unlock();
-        QApplication::processEvents();
-        handleReadStandardOutput();
-        QThread::msleep(ActiveWaitTimeout);
-        if (-1 != msec) {
-            quantumNo++;
+        if (Message::Type::None != result.type) break;
+        if (QProcess::ProcessState::NotRunning == state() && 0 == bytesAvailable()) {
+            qDebug() << "Python subprocess is not running, nothing to wait for";
+            break;
         }
+        const int quantum = -1 == msec
+                ? ActiveWaitTimeout
+                : qBound(0, msec - int(timer.elapsed()), ActiveWaitTimeout);
+        waitForIncomingData(quantum);
     }
     return result;
 }
 
+void PyInterpreterProcess::waitForIncomingData(int msec)
+{
+    // Wakes up as soon as there is something to read rather than
+    // sleeping for a whole quantum, the quantum only limits how long
+    // GUI events are not processed
+    QApplication::processEvents();
+    if (0 == bytesAvailable() && QProcess::ProcessState::NotRunning != state()) {
+        waitForReadyRead(msec);
+    }
+    handleReadStandardOutput();
+}
+
 QString PyInterpreterProcess::pythonExecutablePath()
 {
 #ifdef Q_OS_LINUX
@@ -250,84 +330,179 @@ QString PyInterpreterProcess::pythonExtraPath()
 
 void PyInterpreterProcess::handleReadStandardOutput()
 {
-    _processStdOutLastLineBuffer += readAllStandardOutput();
-    QList<QByteArray> lines = _processStdOutLastLineBuffer.split('\n');
-    if (! _processStdOutLastLineBuffer.endsWith('\n')) {
-        _processStdOutLastLineBuffer = lines.last();
-        lines.pop_back();
+    // Read directly into reusable receive buffer
+    const qint64 available = bytesAvailable();
+    if (available > 0) {
+        const int oldSize = _receiveBuffer.size();
+        _receiveBuffer.resize(oldSize + int(available));
+        const qint64 received = read(_receiveBuffer.data() + oldSize, available);
+        _receiveBuffer.resize(oldSize + int(qMax(Q_INT64_C(0), received)));
     }
-    else {
-        _processStdOutLastLineBuffer.clear();
+
+    // Frame handlers might call this method recursively while waiting
+    // for blocking call result, so positions are kept in fields and
+    // buffer is compacted only by the outermost call
+    _receiveNestingLevel++;
+    forever {
+        const char * data = _receiveBuffer.constData();
+        const int size = _receiveBuffer.size();
+        if (_receiveScanPos >= size) {
+            break;
+        }
+        const char * newLine = static_cast<const char*>(
+                    ::memchr(data + _receiveScanPos, '\n', size - _receiveScanPos)
+                    );
+        if (!newLine) {
+            _receiveScanPos = size;
+            break;
+        }
+        const int frameStart = _receiveFrameStart;
+        const int frameEnd = int(newLine - data);
+        _receiveFrameStart = _receiveScanPos = frameEnd + 1;
+        if (frameEnd > frameStart) {
+            handleIncomingFrame(data + frameStart, frameEnd - frameStart);
+        }
     }
-    Q_FOREACH(const QByteArray &line, lines) {
-        if (!line.isEmpty()) {
-            QJsonParseError parseError;
-            QJsonDocument env = QJsonDocument::fromJson(line, &parseError);
-            if (!env.isNull()) {
-                QJsonObject obj = env.object();
-                const QString type = obj["type"].toString().toLower().trimmed();
-                if ("pong" == type) {
-                    _incomingMessagesMutex.lock();
-                    _incomingMessages.enqueue(Message (Message::Type::Pong) );
-                    _incomingMessagesMutex.unlock();
-                }
-                else if ("blocking_return" == type) {
-                    _incomingMessagesMutex.lock();
-                    _incomingMessages.enqueue(Message (obj["return_value"].toVariant()));
-                    _incomingMessagesMutex.unlock();
-                }
-                else if ("exception" == type) {
-                    if (obj.contains("async_id")) {
-                        qint64 id = obj["async_id"].toVariant().toLongLong();
-                        QString repr = obj["string_data"].toString();
-                        if (_registeredBlockingReceivers.contains(id)) {
-                            QPair<QObject*, QByteArray> receiver = _registeredBlockingReceivers[id];
-                            _registeredBlockingReceivers.remove(id);
-                            QMetaObject::invokeMethod(receiver.first, receiver.second.constData(),
-                                                      Qt::DirectConnection,
-                                                      Q_ARG(bool, false),
-                                                      Q_ARG(QString, repr));
-                        }
-                    }
-                    else {
-                        _incomingMessagesMutex.lock();
-                        _incomingMessages.enqueue(Message (Message::Type::Exception, obj["string_data"].toString()));
-                        _incomingMessagesMutex.unlock();
-                    }
-                }
-                else if ("eval_return" == type) {
-                    qint64 id = obj["async_id"].toVariant().toLongLong();
-                    bool moreLinesRequired = obj["more_lines_required"].toBool();
-                    if (_registeredBlockingReceivers.contains(id)) {
-                        QPair<QObject*, QByteArray> receiver = _registeredBlockingReceivers[id];
-                        _registeredBlockingReceivers.remove(id);
-                        QMetaObject::invokeMethod(receiver.first, receiver.second.constData(),
-                                                  Qt::DirectConnection,
-                                                  Q_ARG(bool, moreLinesRequired));
-                    }
-                }
-                else if ("stdout" == type || "stderr" == type) {
-                    QString msg = obj["string_data"].toString();
-                    if ("stdout" == type) {
-                        emit stdoutReceived(msg);
-                    }
-                    else {
-                        emit stderrReceived(msg);
-                    }
-                }
-                else if ("input_request" == type) {
-                    const QString prompt = obj["prompt"].toString();
-                    emit inputRequiestReceived(prompt);
-                }
-                else if ("reset" == type) {
-                    _registeredBlockingReceivers.clear();
-                    emit resetReceived();
+    _receiveNestingLevel--;
+
+    if (0 == _receiveNestingLevel && _receiveFrameStart > 0) {
+        // Keep the incomplete frame only, allocated memory is reused
+        const int rest = _receiveBuffer.size() - _receiveFrameStart;
+        if (rest > 0) {
+            ::memmove(_receiveBuffer.data(),
+                      _receiveBuffer.constData() + _receiveFrameStart,
+                      rest);
+        }
+        _receiveBuffer.resize(rest);
+        _receiveScanPos -= _receiveFrameStart;
+        _receiveFrameStart = 0;
+    }
+}
+
+void PyInterpreterProcess::handleIncomingFrame(const char *data, int size)
+{
+    QJsonParseError parseError;
+    // Frame data is not copied, it is valid only until JSON parsed
+    const QByteArray frame = QByteArray::fromRawData(data, size);
+    QJsonDocument env = QJsonDocument::fromJson(frame, &parseError);
+    if (!env.isNull()) {
+        QJsonObject obj = env.object();
+        const QString type = obj["type"].toString().toLower().trimmed();
+        if ("pong" == type && !_ready) {
+            _ready = true;
+            emit ready();
+        }
+        else if ("pong" == type) {
+            _incomingMessagesMutex.lock();
+            _incomingMessages.enqueue(Message (Message::Type::Pong) );
+            _incomingMessagesMutex.unlock();
+        }
+        else if ("blocking_return" == type) {
+            _incomingMessagesMutex.lock();
+            _incomingMessages.enqueue(Message (obj["return_value"].toVariant()));
+            _incomingMessagesMutex.unlock();
+        }
+        else if ("exception" == type) {
+            if (obj.contains("async_id")) {
+                flushPendingOutput();
+                qint64 id = obj["async_id"].toVariant().toLongLong();
+                QString repr = obj["string_data"].toString();
+                if (_registeredBlockingReceivers.contains(id)) {
+                    QPair<QObject*, QByteArray> receiver = _registeredBlockingReceivers[id];
+                    _registeredBlockingReceivers.remove(id);
+                    QMetaObject::invokeMethod(receiver.first, receiver.second.constData(),
+                                              Qt::DirectConnection,
+                                              Q_ARG(bool, false),
+                                              Q_ARG(QString, repr));
                 }
             }
             else {
-                qDebug() << "Error parsing incoming message: " << parseError.errorString();
+                _incomingMessagesMutex.lock();
+                _incomingMessages.enqueue(Message (Message::Type::Exception, obj["string_data"].toString()));
+                _incomingMessagesMutex.unlock();
+            }
+        }
+        else if ("eval_return" == type) {
+            qint64 id = obj["async_id"].toVariant().toLongLong();
+            bool moreLinesRequired = obj["more_lines_required"].toBool();
+            flushPendingOutput();
+            if (_registeredBlockingReceivers.contains(id)) {
+                QPair<QObject*, QByteArray> receiver = _registeredBlockingReceivers[id];
+                _registeredBlockingReceivers.remove(id);
+                QMetaObject::invokeMethod(receiver.first, receiver.second.constData(),
+                                          Qt::DirectConnection,
+                                          Q_ARG(bool, moreLinesRequired));
+            }
+        }
+        else if ("stdout" == type || "stderr" == type) {
+            QString msg = obj["string_data"].toString();
+            appendPendingOutput("stdout" == type
+                                ? Message::Type::StdOut : Message::Type::StdErr,
+                                msg);
+        }
+        else if ("input_request" == type) {
+            const QString prompt = obj["prompt"].toString();
+            flushPendingOutput();
+            emit inputRequiestReceived(prompt);
+        }
+        else if ("reset" == type) {
+            flushPendingOutput();
+            _registeredBlockingReceivers.clear();
+            emit resetReceived();
+        }
+        else if (type.startsWith("program_")) {
+            flushPendingOutput();
+            emit programMessageReceived(obj.toVariantMap());
+        }
+    }
+    else {
+        qDebug() << "Error parsing incoming message: " << parseError.errorString();
+    }
+}
+
+void PyInterpreterProcess::appendPendingOutput(Message::Type type, const QString &message)
+{
+    // Consecutive chunks of the same stream are delivered to GUI
+    // as one signal per event loop iteration
+    if (type != _pendingOutputType) {
+        flushPendingOutput();
+        _pendingOutputType = type;
+    }
+    _pendingOutput += message;
+    if (!_pendingOutputFlushScheduled) {
+        _pendingOutputFlushScheduled = true;
+        QTimer::singleShot(0, this, SLOT(flushPendingOutput()));
+    }
+}
+
+void PyInterpreterProcess::flushPendingOutput()
+{
+    _pendingOutputFlushScheduled = false;
+    if (_pendingOutput.isEmpty()) {
+        return;
+    }
+    const QString message = _pendingOutput;
+    const Message::Type type = _pendingOutputType;
+    _pendingOutput.clear();
+    _pendingOutputType = Message::Type::None;
+    if (Message::Type::StdOut == type) {
+        emit stdoutReceived(message);
+    }
+    else {
+        emit stderrReceived(message);
+    }
+    // Output is rendered by directly connected slots at this point,
+    // so let the bridge send more. Bridge counts code points rather
+    // than UTF-16 units, so surrogate pairs are counted once
+    if (QProcess::ProcessState::Running == state()) {
+        int codePoints = message.length();
+        Q_FOREACH(const QChar ch, message) {
+            if (ch.isLowSurrogate()) {
+                codePoints --;
             }
         }
+        sendMessage(Message(Message::Type::OutputCredit,
+                            QVariantList() << codePoints));
     }
 }
 
@@ -339,8 +514,16 @@ void PyInterpreterProcess::handleReadStandardError()
     }
 }
 
+void PyInterpreterProcess::handleStartupTimeout()
+{
+    if (!_ready && QProcess::ProcessState::Running == state()) {
+        qDebug() << "Python subprocess does not respond to ping request";
+    }
+}
+
 void PyInterpreterProcess::handleProcessFinished(int exitCode, QProcess::ExitStatus exitStatus)
 {
+    _ready = false;
     if (_allowProcessRespawn) {
         launchProcess();
         emit processRespawned(exitCode, exitStatus);
@@ -16,7 +16,8 @@ namespace Python3Language {
 struct Message {
     enum class Type {
         None, Exit, Ping, Pong, BlockingCall, BlockingReturn, Exception,
-        NonBlockingEval, StdOut, StdErr, InputRequest, InputResponse
+        NonBlockingEval, StdOut, StdErr, InputRequest, InputResponse,
+        OutputCredit, OutputControl, ProgramControl
     } type;
 
     explicit Message() : type(Type::None) {}
@@ -34,14 +35,19 @@ struct Message {
         returnValue(returnValue_), asyncId(-1) {}
     explicit Message(const Type type_, const QString &stringData_) :
         type(type_), stringData(stringData_), asyncId(-1) {}
+    explicit Message(const Type type_, const QVariantList &arguments_) :
+        type(type_), arguments(arguments_), asyncId(-1) {}
     explicit Message(const qint64 id, const QString &evalString) :
         type(Type::NonBlockingEval), stringData(evalString), asyncId(id) {}
+    explicit Message(const QVariantMap &fields_) :
+        type(Type::ProgramControl), fields(fields_), asyncId(-1) {}
 
     QByteArray moduleName;
     QByteArray functionName;
     QVariantList arguments;
     QVariant returnValue;
     QString stringData;
+    QVariantMap fields;
     qint64 asyncId;
 
 };
@@ -51,7 +57,8 @@ class PyInterpreterProcess : public QProcess
     Q_OBJECT
 public:
     static PyInterpreterProcess* create(bool autoRespawn, QObject * parent = nullptr);
-    bool waitForPong(int msec);
+    inline bool isReady() const { return _ready; }
+    bool waitForReady(int msec);
     QVariant blockingCall(const QByteArray &moduleName,
                           const QByteArray &functionName,
                           const QVariantList &arguments);
@@ -64,16 +71,29 @@ public:
 
     void sendInput(const QString &data);
 
+    // Bridge blocks program output when more than window characters
+    // are not rendered yet; tailLimit > 0 enables 'tail only' mode
+    void setOutputLimits(int window, int tailLimit);
+
+    // Messages to run program in bridge process, see program_runner.py
+    void sendProgramMessage(const QVariantMap &message);
+
+    static QString pythonExecutablePath();
+    static QString pythonExtraPath();
+
 public slots:
     void sendPing();
     void sendExit();
+    void flushPendingOutput();
 
 signals:
     void stdoutReceived(const QString &message);
     void stderrReceived(const QString &message);
     void inputRequiestReceived(const QString &prompt);
     void resetReceived();
+    void programMessageReceived(const QVariantMap &message);
     void processRespawned(int exitCode, QProcess::ExitStatus exitStatus);
+    void ready();
 
 
 protected:
@@ -83,24 +103,36 @@ protected:
 
     void sendMessage(const Message &message);
     Message waitForMessage(Message::Type waitType, int msec);
+    void waitForIncomingData(int msec);
+    void appendPendingOutput(Message::Type type, const QString &message);
+    void handleIncomingFrame(const char * data, int size);
 
 
-
-    static QString pythonExecutablePath();
-    static QString pythonExtraPath();
-
 protected slots:
     void handleReadStandardOutput();
     void handleReadStandardError();
     void handleProcessFinished(int exitCode, QProcess::ExitStatus exitStatus);
+    void handleStartupTimeout();
 
 protected /* fields */:
-    QByteArray _processStdOutLastLineBuffer;
+    QByteArray _receiveBuffer;
+    int _receiveScanPos;
+    int _receiveFrameStart;
+    int _receiveNestingLevel;
     QQueue<Message> _incomingMessages;
     QMutex _incomingMessagesMutex;
     QMap<qint64, QPair<QObject*, QByteArray> > _registeredBlockingReceivers;
+    QString _pendingOutput;
+    Message::Type _pendingOutputType;
+    bool _pendingOutputFlushScheduled;
     bool _allowProcessRespawn;
+    bool _ready;
+    int _outputWindow;
+    int _outputTailLimit;
 
+    static const int ActiveWaitTimeout;
+    static const int ReceiveBufferReserve;
+    static const int StartupTimeout;
     static int DebugPortNumberOffset;
     static qint64 AsyncCallId;
 };
@@ -0,0 +1,227 @@
+#include "pymemoryhook.h"
+
+extern "C" {
+#include <Python.h>
+}
+
+namespace Python3Language {
+
+// Accounting state of one thread running programs. Blocks counted might
+// be freed by other threads even after this one finished, so accounts
+// are never deleted
+struct MemoryAccount {
+    size_t session;
+    quint64 limitBytes;
+    QAtomicInteger<quint64> usedBytes;
+    QAtomicInteger<quint64> peakBytes;
+    QAtomicInt limitExceeded;
+    inline explicit MemoryAccount(): session(0), limitBytes(0), usedBytes(0), peakBytes(0), limitExceeded(0) {}
+};
+
+// Each block is prefixed by header to know its size on free, and whether
+// it was counted by current session of some account rather than earlier
+// one. Header size keeps alignment guaranteed by underlying allocator
+union BlockHeader {
+    struct {
+        size_t size;
+        size_t session;
+        MemoryAccount * account;
+    } block;
+    max_align_t alignment;
+};
+
+static PyMemAllocatorEx originalMemAllocator;
+static PyMemAllocatorEx originalObjAllocator;
+static bool hookInstalled = false;
+
+// All allocations in MEM and OBJ domains are made while interpreter lock
+// held, so there is no concurrent access to accounts, except reading
+// usage from other threads. Several run threads have their own accounts
+static thread_local MemoryAccount * threadAccount = 0;
+static thread_local bool threadCounted = false;
+static QAtomicInteger<quint64> nextSession(1);
+
+static inline MemoryAccount * countedAccount()
+{
+    return threadCounted ? threadAccount : 0;
+}
+
+static inline bool reserve(MemoryAccount * account, size_t size)
+{
+    const quint64 used = account->usedBytes.load() + size;
+    if (account->limitBytes && used > account->limitBytes) {
+        account->limitExceeded.store(1);
+        return false;
+    }
+    account->usedBytes.store(used);
+    if (used > account->peakBytes.load()) {
+        account->peakBytes.store(used);
+    }
+    return true;
+}
+
+static inline void unreserve(MemoryAccount * account, size_t size)
+{
+    account->usedBytes.store(account->usedBytes.load() - size);
+}
+
+static inline bool isCurrent(const BlockHeader * header)
+{
+    return header->block.account && header->block.session == header->block.account->session;
+}
+
+static inline void release(const BlockHeader * header)
+{
+    if (isCurrent(header)) {
+        unreserve(header->block.account, header->block.size);
+    }
+}
+
+static void* wrapBlock(void * raw, size_t size, MemoryAccount * account)
+{
+    if (!raw) {
+        return 0;
+    }
+    BlockHeader * header = static_cast<BlockHeader*>(raw);
+    header->block.size = size;
+    header->block.session = account ? account->session : 0;
+    header->block.account = account;
+    return header + 1;
+}
+
+static void* hook_malloc(void * ctx, size_t size)
+{
+    PyMemAllocatorEx * original = static_cast<PyMemAllocatorEx*>(ctx);
+    if (size > PY_SSIZE_T_MAX - sizeof(BlockHeader)) {
+        return 0;
+    }
+    MemoryAccount * account = countedAccount();
+    if (account && !reserve(account, size)) {
+        return 0;
+    }
+    void * raw = original->malloc(original->ctx, size + sizeof(BlockHeader));
+    if (!raw && account) {
+        unreserve(account, size);
+    }
+    return wrapBlock(raw, size, account);
+}
+
+static void* hook_calloc(void * ctx, size_t nelem, size_t elsize)
+{
+    PyMemAllocatorEx * original = static_cast<PyMemAllocatorEx*>(ctx);
+    if (elsize && nelem > (PY_SSIZE_T_MAX - sizeof(BlockHeader)) / elsize) {
+        return 0;
+    }
+    const size_t size = nelem * elsize;
+    MemoryAccount * account = countedAccount();
+    if (account && !reserve(account, size)) {
+        return 0;
+    }
+    void * raw = original->calloc(original->ctx, 1, size + sizeof(BlockHeader));
+    if (!raw && account) {
+        unreserve(account, size);
+    }
+    return wrapBlock(raw, size, account);
+}
+
+static void* hook_realloc(void * ctx, void * ptr, size_t newSize)
+{
+    if (!ptr) {
+        return hook_malloc(ctx, newSize);
+    }
+    PyMemAllocatorEx * original = static_cast<PyMemAllocatorEx*>(ctx);
+    if (newSize > PY_SSIZE_T_MAX - sizeof(BlockHeader)) {
+        return 0;
+    }
+    BlockHeader * header = static_cast<BlockHeader*>(ptr) - 1;
+    // Block stays in account it was counted by
+    const bool wasCounted = isCurrent(header);
+    MemoryAccount * account = wasCounted ? header->block.account : countedAccount();
+    const size_t oldCountedSize = wasCounted ? header->block.size : 0;
+    const size_t newCountedSize = account ? newSize : 0;
+    if (newCountedSize > oldCountedSize && !reserve(account, newCountedSize - oldCountedSize)) {
+        // Original block is kept untouched on failure
+        return 0;
+    }
+    void * raw = original->realloc(original->ctx, header, newSize + sizeof(BlockHeader));
+    if (!raw) {
+        if (newCountedSize > oldCountedSize) {
+            unreserve(account, newCountedSize - oldCountedSize);
+        }
+        return 0;
+    }
+    if (newCountedSize < oldCountedSize) {
+        unreserve(account, oldCountedSize - newCountedSize);
+    }
+    return wrapBlock(raw, newSize, account);
+}
+
+static void hook_free(void * ctx, void * ptr)
+{
+    if (!ptr) {
+        return;
+    }
+    PyMemAllocatorEx * original = static_cast<PyMemAllocatorEx*>(ctx);
+    BlockHeader * header = static_cast<BlockHeader*>(ptr) - 1;
+    release(header);
+    original->free(original->ctx, header);
+}
+
+extern void installMemoryHook()
+{
+    if (hookInstalled) {
+        return;
+    }
+    hookInstalled = true;
+    PyMem_GetAllocator(PYMEM_DOMAIN_MEM, &originalMemAllocator);
+    PyMem_GetAllocator(PYMEM_DOMAIN_OBJ, &originalObjAllocator);
+    PyMemAllocatorEx memAllocator = {
+        &originalMemAllocator, hook_malloc, hook_calloc, hook_realloc, hook_free
+    };
+    PyMemAllocatorEx objAllocator = {
+        &originalObjAllocator, hook_malloc, hook_calloc, hook_realloc, hook_free
+    };
+    PyMem_SetAllocator(PYMEM_DOMAIN_MEM, &memAllocator);
+    PyMem_SetAllocator(PYMEM_DOMAIN_OBJ, &objAllocator);
+}
+
+extern bool isMemoryHookInstalled()
+{
+    return hookInstalled;
+}
+
+extern void startMemoryAccounting(quint64 limit)
+{
+    if (!threadAccount) {
+        threadAccount = new MemoryAccount;
+    }
+    // Blocks from previous sessions are not counted on free
+    threadAccount->session = size_t(nextSession.fetchAndAddRelaxed(1));
+    threadAccount->limitBytes = limit;
+    threadAccount->usedBytes.store(0);
+    threadAccount->peakBytes.store(0);
+    threadAccount->limitExceeded.store(0);
+    threadCounted = true;
+}
+
+extern void stopMemoryAccounting()
+{
+    threadCounted = false;
+}
+
+extern quint64 memoryInUse()
+{
+    return threadAccount ? threadAccount->usedBytes.load() : 0;
+}
+
+extern quint64 peakMemoryUsage()
+{
+    return threadAccount ? threadAccount->peakBytes.load() : 0;
+}
+
+extern bool memoryLimitExceeded()
+{
+    return threadAccount && 0 != threadAccount->limitExceeded.load();
+}
+
+}
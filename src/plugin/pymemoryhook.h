@@ -0,0 +1,29 @@
+#ifndef PYTHON3LANGUAGE_PYMEMORYHOOK_H
+#define PYTHON3LANGUAGE_PYMEMORYHOOK_H
+
+#include <QtCore>
+
+namespace Python3Language {
+
+// Wraps Python object and memory allocators to account memory allocated
+// by program thread. Must be called before Py_Initialize. Unless called,
+// accounting functions below are no-op and report no memory used
+extern void installMemoryHook();
+extern bool isMemoryHookInstalled();
+
+// Starts accounting allocations made by calling thread. Allocations over
+// limit fail, so MemoryError raised in program. Zero limit means no limit.
+// Each thread has its own account, so several programs run at once
+extern void startMemoryAccounting(quint64 limit);
+extern void stopMemoryAccounting();
+
+// Memory allocated by program of calling thread since accounting started
+// and not freed yet, peak of that value and whether some allocation
+// failed due to limit
+extern quint64 memoryInUse();
+extern quint64 peakMemoryUsage();
+extern bool memoryLimitExceeded();
+
+}
+
+#endif // PYTHON3LANGUAGE_PYMEMORYHOOK_H
@@ -10,10 +10,25 @@ extern "C" {
 #include "pyutils.h"
 #include "sandboxwidget.h"
 #include "syntaxchecksettingspage.h"
+#include "batchgrader.h"
+#include "pymemoryhook.h"
+#include "processrunner.h"
+#include "actorshandler.h"
+
+#include <iostream>
 
 
 namespace Python3Language {
 
+const char * Python3LanguagePlugin::BytecodeCacheDirectoryKey = "Run/BytecodeCacheDirectory";
+const char * Python3LanguagePlugin::StepsCounterIntervalKey = "Run/StepsCounterInterval";
+const char * Python3LanguagePlugin::TestingStepsLimitKey = "Run/TestingStepsLimit";
+const char * Python3LanguagePlugin::TestingTimeLimitKey = "Run/TestingTimeLimit";
+const char * Python3LanguagePlugin::TestingCpuTimeLimitKey = "Run/TestingCpuTimeLimit";
+const char * Python3LanguagePlugin::MemoryLimitKey = "Run/MemoryLimit";
+const char * Python3LanguagePlugin::OutOfProcessKey = "Run/OutOfProcess";
+const char * Python3LanguagePlugin::RecordingMemoryLimitKey = "Run/RecordingMemoryLimit";
+
 Python3LanguagePlugin::Python3LanguagePlugin()
     : ExtensionSystem::KPlugin()
     , _fileHandler(new PyFileHandler(this))
@@ -21,6 +36,8 @@ Python3LanguagePlugin::Python3LanguagePlugin()
     , _sandboxWidget(0)
     , _syntaxCheckSettingsPage(0)
     , _interpreterForAnalizers(0)
+    , _batchGrader(0)
+    , _processRunner(0)
 {
 
 }
@@ -31,7 +48,9 @@ Python3LanguagePlugin::~Python3LanguagePlugin()
     Q_FOREACH(PythonAnalizerInstance *a, _analizerInstances) {
         delete a;
     }
-    _interpreterForAnalizers->deleteLater();
+    if (_interpreterForAnalizers) {
+        _interpreterForAnalizers->deleteLater();
+    }
 }
 
 QList<QWidget *> Python3LanguagePlugin::settingsEditorPages()
@@ -51,7 +70,50 @@ Analizer::SourceFileInterface * Python3LanguagePlugin::sourceFileHandler()
     return _fileHandler;
 }
 
-QString Python3LanguagePlugin::initialize(const QStringList &, const ExtensionSystem::CommandLine &)
+QList<ExtensionSystem::CommandLineParameter> Python3LanguagePlugin::acceptableCommandLineParameters() const
+{
+    // Used by batch grading launcher only
+    QList<ExtensionSystem::CommandLineParameter> result;
+    result << ExtensionSystem::CommandLineParameter(
+                  false,
+                  'o', "output",
+                  tr("Results file name, standard output by default"),
+                  QVariant::String, false
+                  );
+    result << ExtensionSystem::CommandLineParameter(
+                  false,
+                  'j', "jobs",
+                  tr("Number of submissions graded at the same time"),
+                  QVariant::Int, false
+                  );
+    result << ExtensionSystem::CommandLineParameter(
+                  false,
+                  't', "time-limit",
+                  tr("Time limit for each submission in milliseconds"),
+                  QVariant::Int, false
+                  );
+    result << ExtensionSystem::CommandLineParameter(
+                  false,
+                  'm', "memory-limit",
+                  tr("Memory limit for each submission in megabytes"),
+                  QVariant::Int, false
+                  );
+    result << ExtensionSystem::CommandLineParameter(
+                  false,
+                  tr("TASK.py"),
+                  tr("Task file with hidden __pre_run__ and __post_run__ functions"),
+                  QVariant::String, true
+                  );
+    result << ExtensionSystem::CommandLineParameter(
+                  false,
+                  tr("SUBMISSIONS"),
+                  tr("Directory of submission files or single submission file"),
+                  QVariant::String, true
+                  );
+    return result;
+}
+
+QString Python3LanguagePlugin::initialize(const QStringList & configurationArguments, const ExtensionSystem::CommandLine & runtimeArguments)
 {
     qDebug() << "Registering metatypes";
     qRegisterMetaType<Python3Language::ValueRepresentation>("ValueRepresentation");
@@ -80,12 +142,57 @@ QString Python3LanguagePlugin::initialize(const QStringList &, const ExtensionSy
     qDebug() << "Calling _wputenv";
     _wputenv_s(L"PYTHONPATH", wPythonPath);
 #endif
+    // Program memory is accounted by wrapped allocators, which must be
+    // set before any Python object allocated. Each block gets a header
+    // then, so allocators are wrapped only if memory is limited by
+    // settings or measured by batch grader
+    if (configurationArguments.contains("batchgrade")
+            || (mySettings() && mySettings()->value(MemoryLimitKey, 0).toInt() > 0)) {
+        installMemoryHook();
+    }
     Py_Initialize();
     PyEval_InitThreads();
-    runner_ = PythonRunThread::instance(this, myResourcesDir().absolutePath());
+    // Main thread does not run Python code itself, so release interpreter
+    // lock to let run thread and background interpreter warm up take it
+    PyEval_SaveThread();
+    // Compiled programs are kept in memory between runs, and
+    // also on disk if cache directory is set
+    if (mySettings()) {
+        setBytecodeCacheDirectory(mySettings()->value(BytecodeCacheDirectoryKey).toString());
+    }
+    // Actors are plugins shared by all programs run
+    runner_ = new PythonRunThread(new ActorsHandler(this), myResourcesDir().absolutePath(), this);
     connectRunThreadSignals();
+    if (mySettings()) {
+        runner_->setStepsCounterInterval(mySettings()->value(StepsCounterIntervalKey).toInt());
+        applyTestingLimitsSettings();
+        setMemoryLimit(mySettings()->value(MemoryLimitKey, 0).toInt());
+        runner_->setRecordingMemoryLimit(mySettings()->value(RecordingMemoryLimitKey, 64).toInt() * 1024 * 1024);
+    }
+
+    if (configurationArguments.contains("batchgrade")) {
+        // Headless mode, neither sandbox nor analizers required
+        _batchGrader = new BatchGrader(this);
+        _batchGrader->setTaskFileName(runtimeArguments.value(size_t(0)).toString());
+        _batchGrader->setSubmissionsPath(runtimeArguments.value(size_t(1)).toString());
+        _batchGrader->setResultsFileName(runtimeArguments.value('o').toString());
+        if (runtimeArguments.hasFlag('j')) {
+            _batchGrader->setJobsCount(runtimeArguments.value('j').toInt());
+        }
+        if (runtimeArguments.hasFlag('t')) {
+            _batchGrader->setTimeLimit(runtimeArguments.value('t').toInt());
+        }
+        _batchGrader->setMemoryLimit(runtimeArguments.value('m').toInt());
+        return QString();
+    }
+
     _sandboxWidget = new SandboxWidget(myResourcesDir().absolutePath(), 0);
+    // Does not wait for interpreter startup, analizer instances
+    // queue their requests until process becomes ready
     _interpreterForAnalizers = PyInterpreterProcess::create(true, this);
+    if (mySettings()) {
+        setOutOfProcessMode(mySettings()->value(OutOfProcessKey, false).toBool());
+    }
 
     return QString();
 }
@@ -108,6 +215,51 @@ void Python3LanguagePlugin::connectRunThreadSignals()
             runner_, SLOT(setInputResult(QVariantList)));
 }
 
+void Python3LanguagePlugin::setOutOfProcessMode(bool on)
+{
+    // Program crash or heavy load does not affect IDE when run out of
+    // process, for the cost of slower startup and limited debugging
+    if (on == (0 != _processRunner)) {
+        return;
+    }
+    if (on) {
+        disconnect(this, SIGNAL(finishInput(QVariantList)),
+                   runner_, SLOT(setInputResult(QVariantList)));
+        _processRunner = new ProcessRunner(runner_->actorsHandler(), this);
+        connect(_processRunner, SIGNAL(errorOutputRequest(QString)),
+                this, SIGNAL(errorOutputRequest(QString)));
+        connect(_processRunner, SIGNAL(outputRequest(QString)),
+                this, SIGNAL(outputRequest(QString)));
+        connect(_processRunner, SIGNAL(stopped(int)),
+                this, SIGNAL(stopped(int)));
+        connect(_processRunner, SIGNAL(updateStepsCounter(quint64)),
+                this, SIGNAL(updateStepsCounter(quint64)));
+        connect(_processRunner, SIGNAL(lineChanged(int,quint32,quint32)),
+                this, SIGNAL(lineChanged(int,quint32,quint32)));
+        connect(_processRunner, SIGNAL(inputRequest(QString)),
+                this, SIGNAL(inputRequest(QString)));
+        connect(this, SIGNAL(finishInput(QVariantList)),
+                _processRunner, SLOT(setInputResult(QVariantList)));
+    }
+    else {
+        _processRunner->deleteLater();
+        _processRunner = 0;
+        connect(this, SIGNAL(finishInput(QVariantList)),
+                runner_, SLOT(setInputResult(QVariantList)));
+    }
+}
+
+void Python3LanguagePlugin::start()
+{
+    if (_batchGrader) {
+        const QString error = _batchGrader->start();
+        if (!error.isEmpty()) {
+            std::cerr << error.toLocal8Bit().constData() << std::endl;
+            QCoreApplication::exit(1);
+        }
+    }
+}
+
 void Python3LanguagePlugin::stop()
 {
     QCoreApplication::instance()->processEvents();
@@ -118,6 +270,22 @@ void Python3LanguagePlugin::updateSettings(const QStringList & keys)
     if (_syntaxCheckSettingsPage) {
         _syntaxCheckSettingsPage->setSettingsObject(mySettings());
     }
+    if (mySettings() && keys.contains(StepsCounterIntervalKey)) {
+        runner_->setStepsCounterInterval(mySettings()->value(StepsCounterIntervalKey).toInt());
+    }
+    if (mySettings() && (keys.contains(TestingStepsLimitKey) || keys.contains(TestingTimeLimitKey)
+                         || keys.contains(TestingCpuTimeLimitKey))) {
+        applyTestingLimitsSettings();
+    }
+    if (mySettings() && keys.contains(MemoryLimitKey)) {
+        setMemoryLimit(mySettings()->value(MemoryLimitKey, 0).toInt());
+    }
+    if (mySettings() && keys.contains(RecordingMemoryLimitKey)) {
+        runner_->setRecordingMemoryLimit(mySettings()->value(RecordingMemoryLimitKey, 64).toInt() * 1024 * 1024);
+    }
+    if (mySettings() && keys.contains(OutOfProcessKey) && RM_Idle == currentRunMode()) {
+        setOutOfProcessMode(mySettings()->value(OutOfProcessKey, false).toBool());
+    }
     if (mySettings() && keys.contains(SyntaxCheckSettingsPage::UsePep8Key)) {
         Q_FOREACH(PythonAnalizerInstance * analizer, _analizerInstances) {
             analizer->setUsePep8(
@@ -175,6 +343,9 @@ void Python3LanguagePlugin::setStartPageTitleChangeHandler(const QObject *, cons
 
 RunInterface::RunMode Python3LanguagePlugin::currentRunMode() const
 {
+    if (_processRunner) {
+        return _processRunner->currentRunMode();
+    }
     return runner_->currentRunMode();
 }
 
@@ -186,7 +357,12 @@ bool Python3LanguagePlugin::loadProgram(const RunnableProgram & program)
     const QString postRunSource = extractFunction(programSource, "__post_run__");
     const QString preTestSource = extractFunction(programSource, "__pre_test__");
     const QString postTestSource = extractFunction(programSource, "__post_test__");
-    runner_->loadProgram(program.sourceFileName, programSource, preRunSource, postRunSource, preTestSource, postTestSource);
+    if (_processRunner) {
+        _processRunner->loadProgram(program.sourceFileName, programSource, preRunSource, postRunSource, preTestSource, postTestSource);
+    }
+    else {
+        runner_->loadProgram(program.sourceFileName, programSource, preRunSource, postRunSource, preTestSource, postTestSource);
+    }
     loadedProgramVersion_ = QDateTime::currentDateTime();
     return true;
 }
@@ -240,11 +416,17 @@ QStringList Python3LanguagePlugin::extraPaths() const
 
 bool Python3LanguagePlugin::canStepOut() const
 {
+    if (_processRunner) {
+        return _processRunner->canStepOut();
+    }
     return runner_->canStepOut();
 }
 
 bool Python3LanguagePlugin::isTestingRun() const
 {
+    if (_processRunner) {
+        return _processRunner->isTestingMode();
+    }
     return runner_->isTestingMode();
 }
 
@@ -260,6 +442,9 @@ bool Python3LanguagePlugin::hasTestingEntryPoint() const
 
 int Python3LanguagePlugin::currentLineNo() const
 {
+    if (_processRunner) {
+        return _processRunner->currentLineNumber();
+    }
     return runner_->currentLineNumber();
 }
 
@@ -270,57 +455,251 @@ QPair<quint32,quint32> Python3LanguagePlugin::currentColumn() const
 
 QString Python3LanguagePlugin::error() const
 {
+    if (_processRunner) {
+        return _processRunner->errorText();
+    }
     return runner_->errorText();
 }
 
 QVariant Python3LanguagePlugin::valueStackTopItem() const
 {
+    if (_processRunner) {
+        return _processRunner->testingResult();
+    }
     return runner_->testingResult();
 }
 
 unsigned long int Python3LanguagePlugin::stepsCounted() const
 {
+    if (_processRunner) {
+        return _processRunner->stepsCounted();
+    }
     return runner_->stepsCounted();
 }
 
 QAbstractItemModel * Python3LanguagePlugin::debuggerVariablesViewModel() const
 {
+    if (_processRunner) {
+        return _processRunner->variablesModel();
+    }
     return runner_->variablesModel();
 }
 
 void Python3LanguagePlugin::runBlind()
 {
+    if (_processRunner) {
+        _processRunner->startOrContinue(Shared::RunInterface::RM_Blind);
+        return;
+    }
     runner_->startOrContinue(Shared::RunInterface::RM_Blind);
 }
 
 void Python3LanguagePlugin::runContinuous()
 {
+    if (_processRunner) {
+        _processRunner->startOrContinue(Shared::RunInterface::RM_Regular);
+        return;
+    }
     runner_->startOrContinue(Shared::RunInterface::RM_Regular);
 }
 
 void Python3LanguagePlugin::runStepOver()
 {
+    if (_processRunner) {
+        _processRunner->startOrContinue(Shared::RunInterface::RM_StepOver);
+        return;
+    }
     runner_->startOrContinue(Shared::RunInterface::RM_StepOver);
 }
 
 void Python3LanguagePlugin::runStepInto()
 {
+    if (_processRunner) {
+        _processRunner->startOrContinue(Shared::RunInterface::RM_StepIn);
+        return;
+    }
     runner_->startOrContinue(Shared::RunInterface::RM_StepIn); // TODO implement me
 }
 
 void Python3LanguagePlugin::runToEnd()
 {
+    if (_processRunner) {
+        _processRunner->startOrContinue(Shared::RunInterface::RM_StepOut);
+        return;
+    }
     runner_->startOrContinue(Shared::RunInterface::RM_StepOut); // TODO implement me
 }
 
 void Python3LanguagePlugin::runTesting()
 {
+    if (_processRunner) {
+        _processRunner->setTestingMode(true);
+        _processRunner->startOrContinue(Shared::RunInterface::RM_Blind);
+        return;
+    }
+    runner_->setTestingMode(true);
+    runner_->startOrContinue(Shared::RunInterface::RM_Blind);
+}
+
+void Python3LanguagePlugin::runTestingCoverage()
+{
+    // Lines are collected by run thread only
+    if (_processRunner) {
+        runTesting();
+        return;
+    }
     runner_->setTestingMode(true);
+    runner_->setCoverageMode(true);
     runner_->startOrContinue(Shared::RunInterface::RM_Blind);
 }
 
+void Python3LanguagePlugin::setTestingLimits(quint64 steps, int wallTime, int cpuTime)
+{
+    RunLimits limits;
+    limits.steps = steps;
+    limits.wallTime = wallTime;
+    limits.cpuTime = cpuTime;
+    runner_->setRunLimits(limits);
+}
+
+void Python3LanguagePlugin::applyTestingLimitsSettings()
+{
+    setTestingLimits(
+                mySettings()->value(TestingStepsLimitKey, 0).toULongLong(),
+                mySettings()->value(TestingTimeLimitKey, 0).toInt(),
+                mySettings()->value(TestingCpuTimeLimitKey, 0).toInt()
+                );
+}
+
+void Python3LanguagePlugin::setMemoryLimit(int megabytes)
+{
+    if (megabytes > 0 && !isMemoryHookInstalled()) {
+        qDebug() << "Memory limit is applied after restart";
+    }
+    runner_->setMemoryLimit(quint64(qMax(0, megabytes)) * 1024 * 1024);
+}
+
+quint64 Python3LanguagePlugin::peakMemoryUsage() const
+{
+    // Memory is accounted by run thread only
+    if (_processRunner) {
+        return 0;
+    }
+    return runner_->peakMemory();
+}
+
+RunLimitExceeded Python3LanguagePlugin::limitExceeded() const
+{
+    if (_processRunner) {
+        return NoLimitExceeded;
+    }
+    return runner_->limitExceeded();
+}
+
+void Python3LanguagePlugin::runProfiling()
+{
+    // Lines are profiled by run thread only
+    if (_processRunner) {
+        _processRunner->startOrContinue(Shared::RunInterface::RM_Blind);
+        return;
+    }
+    runner_->setProfilingMode(true);
+    runner_->startOrContinue(Shared::RunInterface::RM_Blind);
+}
+
+void Python3LanguagePlugin::runRecording()
+{
+    // History is recorded by run thread only
+    if (_processRunner) {
+        _processRunner->startOrContinue(Shared::RunInterface::RM_Regular);
+        return;
+    }
+    runner_->setRecordingMode(true);
+    runner_->startOrContinue(Shared::RunInterface::RM_Regular);
+}
+
+bool Python3LanguagePlugin::stepBackward()
+{
+    return !_processRunner && runner_->stepBackward();
+}
+
+bool Python3LanguagePlugin::stepForward()
+{
+    return !_processRunner && runner_->stepForward();
+}
+
+QMap<int,LineProfile> Python3LanguagePlugin::lineProfile() const
+{
+    return runner_->lineProfile();
+}
+
+bool Python3LanguagePlugin::exportProfile(const QString &fileName) const
+{
+    // Callgrind format, readable by KCachegrind and similar tools,
+    // with the same costs as shown in editor
+    QFile file(fileName);
+    if (!file.open(QIODevice::WriteOnly|QIODevice::Text)) {
+        return false;
+    }
+    const QMap<int,LineProfile> profile = runner_->lineProfile();
+    QTextStream ts(&file);
+    ts.setCodec("UTF-8");
+    ts << "# callgrind format\n";
+    ts << "version: 1\n";
+    ts << "creator: kumir2-python\n";
+    ts << "positions: line\n";
+    ts << "events: Hits Nanoseconds\n";
+    ts << "\n";
+    const QString programFileName = runner_->programFileName();
+    ts << "fl=" << (programFileName.isEmpty() ? QString("<program>") : programFileName) << "\n";
+    QString function;
+    for (QMap<int,LineProfile>::const_iterator it=profile.constBegin(); it!=profile.constEnd(); ++it) {
+        if (it.value().function != function || it == profile.constBegin()) {
+            function = it.value().function;
+            ts << "fn=" << function << "\n";
+        }
+        ts << it.key() + 1 << " " << it.value().hits << " " << it.value().nsecs << "\n";
+    }
+    return QFile::NoError == file.error();
+}
+
+QMap<int,bool> Python3LanguagePlugin::lineCoverage() const
+{
+    return runner_->lineCoverage();
+}
+
+bool Python3LanguagePlugin::exportCoverage(const QString &fileName) const
+{
+    // LCOV tracefile format, readable by genhtml and most CI tools
+    QFile file(fileName);
+    if (!file.open(QIODevice::WriteOnly|QIODevice::Text)) {
+        return false;
+    }
+    const QMap<int,bool> coverage = runner_->lineCoverage();
+    QTextStream ts(&file);
+    ts.setCodec("UTF-8");
+    ts << "TN:\n";
+    const QString programFileName = runner_->programFileName();
+    ts << "SF:" << (programFileName.isEmpty() ? QString("<program>") : programFileName) << "\n";
+    int linesHit = 0;
+    for (QMap<int,bool>::const_iterator it=coverage.constBegin(); it!=coverage.constEnd(); ++it) {
+        ts << "DA:" << it.key() + 1 << "," << (it.value() ? 1 : 0) << "\n";
+        if (it.value()) {
+            linesHit ++;
+        }
+    }
+    ts << "LH:" << linesHit << "\n";
+    ts << "LF:" << coverage.size() << "\n";
+    ts << "end_of_record\n";
+    return QFile::NoError == file.error();
+}
+
 void Python3LanguagePlugin::terminate()
 {
+    if (_processRunner) {
+        _processRunner->terminate();
+        return;
+    }
     runner_->terminate();
 }
 
@@ -332,12 +711,18 @@ void Python3LanguagePlugin::terminateAndWaitForStopped()
 void Python3LanguagePlugin::removeAllBreakpoints()
 {
     qDebug() << "Remove all breakpoints";
+    if (_processRunner) {
+        _processRunner->removeAllBreakpoints();
+    }
     runner_->removeAllBreakpoints();
 }
 
 void Python3LanguagePlugin::insertSingleHitBreakpoint(const QString &fileName, quint32 lineNo)
 {
     BreakpointLocation location(fileName, lineNo);
+    if (_processRunner) {
+        _processRunner->insertSingleHitBreakpoint(location);
+    }
     runner_->insertSingleHitBreakpoint(location);
 }
 
@@ -345,7 +730,10 @@ void Python3LanguagePlugin::insertOrChangeBreakpoint(bool enabled, const QString
 {
     qDebug() << "Insert breakpoint: " << fileName << ":" << lineNo;
     BreakpointLocation location(fileName, lineNo);
-    BreakpointData data; data.condition = condition; data.ignoreCount = ignoreCount;
+    BreakpointData data; data.condition = condition; data.ignoreCount = ignoreCount; data.enabled = enabled;
+    if (_processRunner) {
+        _processRunner->addOrChangeBreakpoint(location, data);
+    }
     runner_->addOrChangeBreakpoint(location, data);
 }
 
@@ -353,6 +741,9 @@ void Python3LanguagePlugin::removeBreakpoint(const QString &fileName, quint32 li
 {
     qDebug() << "Remove breakpoint: " << fileName << ":" << lineNo;
     BreakpointLocation location(fileName, lineNo);
+    if (_processRunner) {
+        _processRunner->removeBreakpoint(location);
+    }
     runner_->removeBreakpoint(location);
 }
 
@@ -23,6 +23,10 @@ struct Python3Module;
 class PythonRunThread;
 class PyFileHandler;
 class SyntaxCheckSettingsPage;
+class BatchGrader;
+class ProcessRunner;
+struct LineProfile;
+enum RunLimitExceeded : int;
 
 using namespace Shared;
 
@@ -45,6 +49,7 @@ public:
 
     // KPlugin methods
     QList<QWidget*> settingsEditorPages();
+    QList<ExtensionSystem::CommandLineParameter> acceptableCommandLineParameters() const;
 
     // Analizer interface methods
     Analizer::InstanceInterface * createInstance();
@@ -70,6 +75,33 @@ public:
     QVariant valueStackTopItem() const;
     unsigned long int stepsCounted() const;
     QAbstractItemModel * debuggerVariablesViewModel() const;
+
+    // Profiler results of the last profiling run, by zero based line number,
+    // to be shown by editor next to program lines
+    QMap<int,LineProfile> lineProfile() const;
+    bool exportProfile(const QString & fileName) const;
+
+    // Executable lines of the last coverage run by zero based number,
+    // whether executed by any testing iteration
+    QMap<int,bool> lineCoverage() const;
+    bool exportCoverage(const QString & fileName) const;
+
+    // Moves through history of the last recording run, shown in editor
+    // and variables view while program is paused or finished
+    bool stepBackward();
+    bool stepForward();
+
+    // Limits for each testing iteration, zero values mean no limit.
+    // Exceeded limit stops testing with error
+    void setTestingLimits(quint64 steps, int wallTime, int cpuTime);
+    RunLimitExceeded limitExceeded() const;
+
+    // Memory allocated by program, zero limit means no limit.
+    // Allocations over limit raise MemoryError in program. Programs
+    // run out of process are neither limited nor measured, and neither
+    // are programs if no limit was set at startup
+    void setMemoryLimit(int megabytes);
+    quint64 peakMemoryUsage() const;
     void setStdInTextStream(QTextStream *stream);
     void setStdOutTextStream(QTextStream *stream);
 
@@ -97,6 +129,9 @@ public Q_SLOTS:
     void runStepInto();
     void runToEnd();
     void runTesting();
+    void runTestingCoverage();
+    void runProfiling();
+    void runRecording();
     void terminate();
     void terminateAndWaitForStopped();
 
@@ -108,11 +143,23 @@ public Q_SLOTS:
 protected:    
     void createPluginSpec();
     void connectRunThreadSignals();
+    void applyTestingLimitsSettings();
+    void setOutOfProcessMode(bool on);
     QString initialize(const QStringList &, const ExtensionSystem::CommandLine &);
+    void start();
     void stop();
     static QString extractFunction(const QString & source, const QString &funcName);
     QStringList extraPaths() const;
 
+    static const char * BytecodeCacheDirectoryKey;
+    static const char * StepsCounterIntervalKey;
+    static const char * TestingStepsLimitKey;
+    static const char * TestingTimeLimitKey;
+    static const char * TestingCpuTimeLimitKey;
+    static const char * MemoryLimitKey;
+    static const char * OutOfProcessKey;
+    static const char * RecordingMemoryLimitKey;
+
 protected Q_SLOTS:
     void updateSettings(const QStringList &);
 
@@ -126,6 +173,9 @@ private /*fields*/:
     SyntaxCheckSettingsPage * _syntaxCheckSettingsPage;
 
     PyInterpreterProcess * _interpreterForAnalizers;
+    BatchGrader * _batchGrader;
+    // Set when programs run in separate process rather than in run thread
+    ProcessRunner * _processRunner;
 
 
     // RunInterface interface
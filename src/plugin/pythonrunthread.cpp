@@ -4,39 +4,129 @@
 #include "pyutils.h"
 #include <kumir2/runinterface.h>
 #include "variablesmodel.h"
+#include "pyinterpreterprocess.h"
+#include "pymemoryhook.h"
 
 extern "C" {
 #include <Python.h>
 }
 
+#if defined(Q_OS_WIN32)
+#include <windows.h>
+#elif defined(Q_OS_UNIX) && !defined(Q_OS_MAC)
+#include <pthread.h>
+#include <time.h>
+#endif
+
 namespace Python3Language {
 
 using namespace Shared;
 
-PythonRunThread* PythonRunThread::self = 0;
+const int PythonRunThread::DefaultStepsCounterInterval = 200;
+const int PythonRunThread::InterpreterPoolSize = 2;
+const int PythonRunThread::LimitsCheckInterval = 1000;
+const int PythonRunThread::LimitsWatchdogInterval = 100;
+const int PythonRunThread::TerminateRepeatInterval = 20;
+const int PythonRunThread::InterruptsBeforeEscalation = 3;
+const int PythonRunThread::ParallelBatchStartupTime = 2000;
+const int PythonRunThread::DefaultRecordingMemoryLimit = 64 * 1024 * 1024;
 
-PythonRunThread* PythonRunThread::instance(QObject *parent, const QString &extraPythonPath)
-{
-    if (!self) {
-        self = new PythonRunThread(parent, extraPythonPath);
-    }
-    return self;
-}
+// Key of run thread capsule in interpreter dictionary
+static const char * RunThreadContextKey = "kumir2.run_thread";
 
-PythonRunThread::PythonRunThread(QObject *parent, const QString & extraPythonPath)
+PythonRunThread::PythonRunThread(ActorsHandler *actorsHandler, const QString & extraPythonPath, QObject *parent)
     : QThread(parent)
-    , callback_(InterpreterCallback::instance(this))
-    , actorsHandler_(ActorsHandler::instance(this))
+    , requestedMode_(RunInterface::RM_Idle)
+    , paused_(0)
+    , activeMode_(RunInterface::RM_Idle)
+    , userFrameDepth_(0)
+    , targetDepth_(0)
+    , callback_(new InterpreterCallback(this))
+    , actorsHandler_(actorsHandler)
     , pythonPath_(extraPythonPath)
     , mutex_(new QMutex)
+    , interruptMutex_(new QMutex)
+    , programThreadState_(0)
+    , terminatedException_(0)
+    , interruptsCount_(0)
+    , traced_(false)
+#if PY_VERSION_HEX >= 0x030B0000
+    , traceLinesName_(0)
+#endif
+    , monitoring_(0)
+    , monitoringDisable_(0)
+    , monitoringLocalEvents_(0)
+    , pendingException_(0)
     , testingMode_(false)
+    , profilingMode_(false)
+    , profiling_(false)
+    , profiledLine_(-1)
+    , profiledLineStart_(0)
+    , coverageMode_(false)
+    , covering_(false)
+    , coverageOnly_(false)
+    , recordingMode_(false)
+    , recording_(false)
+    , recordingMemoryLimit_(DefaultRecordingMemoryLimit)
     , runPauseSemaphore_(new QSemaphore(0))
     , runInputSemaphore_(new QSemaphore(0))
     , variablesModel_(new VariablesModel(this))
-    , canStepOut_(false)
+    , interpreterPool_(new SubInterpreterPool(extraPythonPath, InterpreterPoolSize))
+    , canStepOut_(0)
+    , hasForcedGlobalValues_(0)
+    , forcedGlobalValuesVersion_(0)
+    , forcedGlobalsVersion_(-1)
+    , forcedGlobalsDict_(0)
+    , forcedGlobalsChanged_(true)
+#if PY_VERSION_HEX >= 0x030C0000
+    , forcedGlobalsWatcher_(-1)
+    , applyingForcedGlobals_(false)
+#elif PY_VERSION_HEX >= 0x03060000
+    , forcedGlobalsDictVersion_(0)
+#endif
     , testRunCount_(1u)
+    , parallelTestRuns_(false)
+    , hasBreakpoints_(0)
+    , breakpointsVersion_(0)
+    , breakpointLinesVersion_(-1)
+    , pendingLineNumber_(-1)
+    , lineChangePending_(0)
+    , stepsTimer_(new QTimer(this))
+    , stepsReported_(0)
+    , limitsCheckCountdown_(LimitsCheckInterval)
+    , hasRunLimits_(0)
+    , limitExceeded_(NoLimitExceeded)
+    , limitsTimer_(new QTimer(this))
+    , terminateTimer_(new QTimer(this))
+    , terminateRequestTime_(-1)
+    , memoryLimit_(0)
+    , peakMemory_(0)
+    , iterationStartTime_(0)
+    , iterationStartCpuTime_(0)
+    , runningParallelIterations_(0)
+#if defined(Q_OS_WIN32)
+    , runThreadHandle_(0)
+#elif defined(Q_OS_UNIX) && !defined(Q_OS_MAC)
+    , runThreadCpuClockValid_(false)
+#endif
 {
     qDebug() << "Run thread: connecting signals/slots";
+    stepsTimer_->setInterval(DefaultStepsCounterInterval);
+    connect(stepsTimer_, SIGNAL(timeout()),
+            this, SLOT(sampleStepsCounter()));
+    connect(this, SIGNAL(finished()),
+            stepsTimer_, SLOT(stop()));
+    clock_.start();
+    limitsTimer_->setInterval(LimitsWatchdogInterval);
+    connect(limitsTimer_, SIGNAL(timeout()),
+            this, SLOT(checkRunLimits()));
+    connect(this, SIGNAL(finished()),
+            limitsTimer_, SLOT(stop()));
+    terminateTimer_->setInterval(TerminateRepeatInterval);
+    connect(terminateTimer_, SIGNAL(timeout()),
+            this, SLOT(repeatTerminate()));
+    connect(this, SIGNAL(finished()),
+            terminateTimer_, SLOT(stop()));
     connect(callback_, SIGNAL(errorMessageRequest(QString)),
             this, SIGNAL(errorOutputRequest(QString)),
             Qt::DirectConnection);
@@ -52,26 +142,83 @@ PythonRunThread::PythonRunThread(QObject *parent, const QString & extraPythonPat
     qDebug() << "Run thread: created";
 }
 
+PythonRunThread::~PythonRunThread()
+{
+    // Program is stopped as by user, but there is no event loop
+    // to repeat interruption, so it is repeated here
+    stopping_.storeRelease(1);
+    while (isRunning() && !wait(TerminateRepeatInterval)) {
+        releaseSemaphores();
+        interruptProgram();
+    }
+    // Pool ends its idle interpreters, so lock must not be held
+    delete interpreterPool_;
+}
+
+PythonRunThread * PythonRunThread::current()
+{
+    // Must be called while interpreter lock held
+#if PY_VERSION_HEX >= 0x03080000
+    PyObject * dict = PyInterpreterState_GetDict(PyThreadState_Get()->interp);
+    PyObject * context = dict ? PyDict_GetItemString(dict, RunThreadContextKey) : 0;
+#else
+    PyObject * context = PySys_GetObject(const_cast<char*>(RunThreadContextKey));
+#endif
+    return context && PyCapsule_CheckExact(context) ? fromContext(context) : 0;
+}
+
+void PythonRunThread::setInterpreterContext()
+{
+    // Functions of _kumir module find run thread by interpreter
+    // they are called from, so several programs might run at once
+    PyObject * context = PyCapsule_New(this, 0, 0);
+#if PY_VERSION_HEX >= 0x03080000
+    PyObject * dict = PyInterpreterState_GetDict(PyThreadState_Get()->interp);
+    if (dict) {
+        PyDict_SetItemString(dict, RunThreadContextKey, context);
+    }
+#else
+    PySys_SetObject(const_cast<char*>(RunThreadContextKey), context);
+#endif
+    Py_DECREF(context);
+}
+
 void PythonRunThread::reset()
 {
     QMutexLocker l(mutex_);
-    lineNumber_ = -1;
+    lineNumber_.storeRelease(-1);
     forcedGlobalValues_.clear();
+    hasForcedGlobalValues_.storeRelease(0);
+    forcedGlobalValuesVersion_.fetchAndAddRelease(1);
     errorText_.clear();
+    hasErrorText_.storeRelease(0);
     testingResult_.clear();
-    stepsCounted_ = 0;
+    stepsCounted_.storeRelease(0);
     justStarted_ = true;
-    stopping_ = false;
+    stopping_.storeRelease(0);
+    limitsCheckCountdown_ = LimitsCheckInterval;
+    iterationStartCpuTime_.storeRelease(runThreadCpuTime());
+    iterationStartTime_.storeRelease(clock_.elapsed());
     releaseSemaphores();
     runPauseSemaphore_->acquire();
     runInputSemaphore_->acquire();
-    canStepOut_ = false;
+    paused_.storeRelease(0);
+    canStepOut_.storeRelease(0);
+    userFrameDepth_ = 0;
+    applyRequestedMode();
 }
 
 void PythonRunThread::forceGlobalVariableValue(const QByteArray &name, PyObject *value)
 {
     QMutexLocker l(mutex_);
     forcedGlobalValues_[name] = value;
+    hasForcedGlobalValues_.storeRelease(1);
+    forcedGlobalValuesVersion_.fetchAndAddRelease(1);
+    if (QThread::currentThread() == this && !traced_) {
+        // Called by program itself while interpreter lock held, so
+        // start tracing to apply forced values
+        startTracing();
+    }
 }
 
 void PythonRunThread::removeAllBreakpoints()
@@ -79,18 +226,24 @@ void PythonRunThread::removeAllBreakpoints()
     QMutexLocker l(mutex_);
     breakpoints_.clear();
     singleHits_.clear();
+    hasBreakpoints_.storeRelease(0);
+    breakpointsVersion_.fetchAndAddRelease(1);
 }
 
 void PythonRunThread::insertSingleHitBreakpoint(const BreakpointLocation &location)
 {
     QMutexLocker l(mutex_);
     singleHits_.insert(location);
+    hasBreakpoints_.storeRelease(1);
+    breakpointsVersion_.fetchAndAddRelease(1);
 }
 
 void PythonRunThread::addOrChangeBreakpoint(const BreakpointLocation &location, const BreakpointData &data)
 {
     QMutexLocker l(mutex_);
     breakpoints_[location] = data;
+    hasBreakpoints_.storeRelease(1);
+    breakpointsVersion_.fetchAndAddRelease(1);
 }
 
 void PythonRunThread::removeBreakpoint(const BreakpointLocation &location)
@@ -98,11 +251,15 @@ void PythonRunThread::removeBreakpoint(const BreakpointLocation &location)
     QMutexLocker l(mutex_);
     if (breakpoints_.contains(location))
         breakpoints_.remove(location);
+    hasBreakpoints_.storeRelease(!breakpoints_.isEmpty() || !singleHits_.isEmpty());
+    breakpointsVersion_.fetchAndAddRelease(1);
 }
 
 RunInterface::RunMode PythonRunThread::currentRunMode() const
 {
-    return runMode_.isEmpty() ? RunInterface::RM_Idle : runMode_.top();
+    return isRunning()
+            ? RunInterface::RunMode(requestedMode_.loadAcquire())
+            : RunInterface::RM_Idle;
 }
 
 void PythonRunThread::setStdInStream(QTextStream *stream)
@@ -129,8 +286,16 @@ void PythonRunThread::releaseSemaphores()
 
 void PythonRunThread::run()
 {
+#if defined(Q_OS_WIN32)
+    runThreadHandle_ = OpenThread(THREAD_QUERY_LIMITED_INFORMATION, FALSE, GetCurrentThreadId());
+#elif defined(Q_OS_UNIX) && !defined(Q_OS_MAC)
+    runThreadCpuClockValid_ = 0 == pthread_getcpuclockid(pthread_self(), &runThreadCpuClock_);
+#endif
     testRunCount_ = 1u;
+    parallelTestRuns_ = false;
     bool firstRun = true;
+    coverableLines_.clear();
+    lineCoverageData_.clear();
 
     while (testRunCount_) {
         // Clear states
@@ -139,60 +304,72 @@ void PythonRunThread::run()
         actorsHandler_->reset();
         variablesModel_->resetModel();
 
-        // Initialize interpreter in current thread
-        PyGILState_Ensure();
-        PyThreadState * py = Py_NewInterpreter();
-    #ifdef Q_OS_WIN32
-        prepareBundledSysPath();
-    #else
-        appendToSysPath(pythonPath_);
-    #endif        
-        createSysArgv(QStringList() << QDir::current().relativeFilePath(sourceProgramPath_));
-        PyObject* py_run_wrapper = PyImport_ImportModule("run_wrapper");
-        if (!py_run_wrapper) { printPythonTraceback(); return; }
-        PyEval_ReleaseThread(py);
+        // Take interpreter warmed up in background if any
+        const ModuleSources actorModules = actorModuleSources();
+        PyThreadState * py = interpreterPool_->take(actorModules);
+        if (py) {
+            PyEval_AcquireThread(py);
+            createSysArgv(QStringList() << QDir::current().relativeFilePath(sourceProgramPath_));
+            PyEval_ReleaseThread(py);
+        }
+        else {
+            // Initialize interpreter in current thread
+            PyGILState_Ensure();
+            py = Py_NewInterpreter();
+        #ifdef Q_OS_WIN32
+            prepareBundledSysPath();
+        #else
+            appendToSysPath(pythonPath_);
+        #endif
+            createSysArgv(QStringList() << QDir::current().relativeFilePath(sourceProgramPath_));
+            PyObject* py_run_wrapper = PyImport_ImportModule("run_wrapper");
+            if (!py_run_wrapper) { printPythonTraceback(); return; }
+            PyEval_ReleaseThread(py);
 
-        // Create actor 'modules'
-        clearCreatedModules();
-        for (int i=0; i<actorsHandler_->size(); i++) {
-            const QString source = actorsHandler_->moduleWrapper(i);
-            const QString name = actorsHandler_->moduleName(i);
-            createModuleFromSource(py, name, source);
+            // Create actor 'modules'
+            for (int i=0; i<actorModules.size(); i++) {
+                createModuleFromSource(py, actorModules.at(i).first, actorModules.at(i).second);
+            }
         }
 
+        PyEval_AcquireThread(py);
+        setInterpreterContext();
+        PyEval_ReleaseThread(py);
+
         // Prepare pre-run and post-run program code
+        int errorLineNumber = -1;
         mutex_->lock();
         PyEval_AcquireThread(py);
         PyObject * preTestCode = 0;
         PyObject * postTestCode = 0;
         PyObject * preCode = 0;
         if (preTestSource_.trimmed().length() > 0)
-            preTestCode = compileModule(
+            preTestCode = compileModuleCached(
                     QString("<hidden>"),
                     preTestSource_,
-                    &lineNumber_,
+                    &errorLineNumber,
                     &errorText_
                     );
         if (postTestSource_.trimmed().length() > 0)
-            postTestCode = compileModule(
+            postTestCode = compileModuleCached(
                     QString("<hidden>"),
                     postTestSource_,
-                    &lineNumber_,
+                    &errorLineNumber,
                     &errorText_
                     );
         if (preRunSource_.trimmed().length() > 0)
-            preCode = compileModule(
+            preCode = compileModuleCached(
                     QString("<hidden>"),
                     preRunSource_,
-                    &lineNumber_,
+                    &errorLineNumber,
                     &errorText_
                     );
         PyObject * postCode = 0;
         if (postRunSource_.trimmed().length() > 0)
-            postCode = compileModule(
+            postCode = compileModuleCached(
                     QString("<hidden>"),
                     postRunSource_,
-                    &lineNumber_,
+                    &errorLineNumber,
                     &errorText_
                     );
         PyEval_ReleaseThread(py);
@@ -201,15 +378,24 @@ void PythonRunThread::run()
         // Prepare main program code
         mutex_->lock();
         PyEval_AcquireThread(py);
-        PyObject * code = compileModule(
+        PyObject * code = compileModuleCached(
                     sourceProgramPath_.isEmpty()
                     ? QString("<program>") : sourceProgramPath_,
                     sourceProgram_,
-                    &lineNumber_,
+                    &errorLineNumber,
                     &errorText_
                     );
         PyEval_ReleaseThread(py);
         bool testingMode = testingMode_;
+        bool profilingMode = profilingMode_;
+        bool coverageMode = coverageMode_;
+        bool recordingMode = recordingMode_ && !testingMode;
+        int recordingMemoryLimit = recordingMemoryLimit_;
+        quint64 memoryLimit = memoryLimit_;
+        if (!errorText_.isEmpty()) {
+            lineNumber_.storeRelease(errorLineNumber);
+            hasErrorText_.storeRelease(1);
+        }
         mutex_->unlock();
 
         if (!code) {
@@ -218,8 +404,34 @@ void PythonRunThread::run()
         }
         else {
             PyEval_AcquireThread(py);
-            // Set interpreter tracing
-            PyEval_SetTrace(&python_trace_dispatch, 0);
+            if (coverageMode && firstRun) {
+                findCoverableLines(code);
+            }
+            // Covered lines need no more events unless something
+            // else is checked at each line
+            covering_ = coverageMode;
+            coverageOnly_ = coverageMode && testingMode && RunInterface::RM_Blind == activeMode_
+                    && !profilingMode && !activeRunLimits_.steps;
+            // Set interpreter tracing. Breakpoints are not checked while
+            // running blind, so there is no need to trace at all unless
+            // forced global values set by testing code, or steps counted
+            // for testing results and limits
+            traced_ = RunInterface::RM_Blind != activeMode_
+                    || hasBreakpoints_.loadAcquire() || profilingMode || recordingMode || coverageMode
+                    || testingMode || activeRunLimits_.steps;
+            if (traced_) {
+                startTracing();
+            }
+            // Program might be interrupted from now on, even if traced,
+            // since trace function is not called within long C calls
+            PyObject * terminatedException = PyErr_NewException(
+                        const_cast<char*>("__kumir__.ProgramTerminated"), PyExc_BaseException, 0);
+            interruptMutex_->lock();
+            programThreadState_ = py;
+            terminatedException_ = terminatedException;
+            interruptsCount_ = 0;
+            interruptMutex_->unlock();
+            startMemoryAccounting(memoryLimit);
 
             // Create main module
             // NOTE in this stage name must be '__main__' to ensure builtins available
@@ -250,7 +462,25 @@ void PythonRunThread::run()
             }
 
             // Evaluate
-            PyEval_EvalCode(code, globals, globals);
+            if (profilingMode) {
+                startProfiling();
+            }
+            // History of previous run is dropped even if not recording
+            executionRecording_.start(recordingMode ? recordingMemoryLimit : 0);
+            recording_ = recordingMode;
+            PyObject * result = PyEval_EvalCode(code, globals, globals);
+            recording_ = false;
+            covering_ = false;
+            executionRecording_.finish();
+            if (profilingMode) {
+                finishProfiling();
+            }
+            if (!result && !traced_) {
+                // Exceptions are not reported while not tracing,
+                // so take error status from one escaped program
+                storeEscapedException();
+            }
+            Py_XDECREF(result);
 
             // In tesing mode call __post_run__ if present
             if (testingMode && postCode) {
@@ -271,6 +501,18 @@ void PythonRunThread::run()
                 }
             }
 
+            // In testing mode run remaining iterations at once in worker
+            // processes if requested by __pre_test__, unless lines run by
+            // iterations are collected. The last one is still run here to
+            // call __post_test__ after all
+            if (testingMode && firstRun && parallelTestRuns_ && testRunCount_ > 2u && !coverageMode) {
+                PyEval_ReleaseThread(py);
+                if (runParallelTestIterations(testRunCount_ - 2u)) {
+                    testRunCount_ = 2u;
+                }
+                PyEval_AcquireThread(py);
+            }
+
             // In testing mode call __post_test__ if present after all
             if (testingMode && postTestCode && 1u==testRunCount_) {
                 PyEval_EvalCode(postTestCode, globals, globals);
@@ -288,198 +530,1090 @@ void PythonRunThread::run()
                 }
             }
 
+            stopMemoryAccounting();
+            if (peakMemoryUsage() > peakMemory_.load()) {
+                peakMemory_.store(peakMemoryUsage());
+            }
+            if (memoryLimitExceeded()) {
+                limitExceeded_.testAndSetOrdered(NoLimitExceeded, MemoryLimitExceeded);
+            }
+
+            // Set error status if the last exception raised by
+            // program code was not handled
+            formatPendingException();
+
             // Unset interpreter tracing
-            PyEval_SetTrace(0 ,0);
+            stopTracing();
+            PyEval_ReleaseThread(py);
+
+            // Must not be interrupted after interpreter lock released
+            interruptMutex_->lock();
+            programThreadState_ = 0;
+            terminatedException = terminatedException_;
+            terminatedException_ = 0;
+            interruptMutex_->unlock();
+            PyEval_AcquireThread(py);
+            // Termination request might arrive after program finished
+            PyEval_SetTrace(0, 0);
+            PyThreadState_SetAsyncExc(py->thread_id, 0);
+            Py_DECREF(terminatedException);
             PyEval_ReleaseThread(py);
         }
 
         // Finalize interpreter
         PyEval_AcquireThread(py);
+        if (coverageMode) {
+            collectCoverage();
+        }
+        clearCodeObjectsCache();
+        clearForcedGlobalsCache();
+        clearCreatedModules(py->interp);
         Py_EndInterpreter(py);
         py = 0;
         PyEval_ReleaseLock();
 
         firstRun = false;
         testRunCount_ --;
+
+        if (NoLimitExceeded != limitExceeded_.loadAcquire()) {
+            // Other iterations are likely to exceed the same limit
+            break;
+        }
+        if (stopping_.loadAcquire()) {
+            // Next iteration would reset stop request
+            break;
+        }
     } // end while (testRunCount_)
 
-    Q_EMIT updateStepsCounter(stepsCounted_);
+    const qint64 terminateRequestTime = terminateRequestTime_.fetchAndStoreOrdered(-1);
+    if (-1 != terminateRequestTime) {
+        qDebug() << "Program terminated in" << clock_.elapsed() - terminateRequestTime << "ms";
+    }
+
+    Q_EMIT updateStepsCounter(stepsCounted_.loadAcquire());
+    finishCoverage();
 
     RunInterface::StopReason exitStatus = RunInterface::SR_Done;
     mutex_->lock();
-    if (stopping_)
+    const int limit = limitExceeded_.loadAcquire();
+    if (NoLimitExceeded != limit) {
+        errorText_ = limitExceededMessage(limit);
+        hasErrorText_.storeRelease(1);
+        testingResult_.clear();
+        exitStatus = RunInterface::SR_Error;
+    }
+    else if (stopping_.loadAcquire())
         exitStatus = RunInterface::SR_UserTerminated;
     else if (errorText_.length() > 0)
         exitStatus = RunInterface::SR_Error;
     mutex_->unlock();
+#if defined(Q_OS_WIN32)
+    CloseHandle(runThreadHandle_);
+    runThreadHandle_ = 0;
+#elif defined(Q_OS_UNIX) && !defined(Q_OS_MAC)
+    runThreadCpuClockValid_ = false;
+#endif
+    // Interpreters are warmed up while idle, not to compete
+    // with program for interpreter lock
+    interpreterPool_->refill(actorModuleSources());
     Q_EMIT stopped(exitStatus);
     setTestingMode(false);
+    setProfilingMode(false);
+    setRecordingMode(false);
+    setCoverageMode(false);
     setStdInStream(0);
     setStdOutStream(0);
 }
 
-int PythonRunThread::python_trace_dispatch(PyObject *, PyFrameObject *frame, int what, PyObject *arg)
+#if PY_VERSION_HEX >= 0x030C0000
+int PythonRunThread::python_terminate_dispatch(PyObject *exception, PyFrameObject *, int, PyObject *)
 {
-    const QString fileName = PyUnicodeToQString(frame->f_code->co_filename);
-    static const QString DummyFileName = QString::fromLatin1("<program>");
-    const bool sameFile = DummyFileName==fileName || fileName==self->sourceProgramPath_;
-    bool mustStop = false;
-
-    self->mutex_->lock();
-    self->canStepOut_ = frame->f_back != 0;
-    self->mutex_->unlock();
-
-    if (!mustStop) {
-        if (sameFile) {
-
-            int lineNumber = PyFrame_GetLineNumber(frame) - 1;
-            self->mutex_->lock();
-            self->lineNumber_ = lineNumber;
-            self->mutex_->unlock();
-
-            if (PyTrace_LINE==what || PyTrace_CALL==what || PyTrace_C_CALL==what) {
-                // Program not broken, so clear possible previous error flag
-                self->mutex_->lock();
-                self->errorText_.clear();
-                self->mutex_->unlock();
-            }
+    // Raised at every event, so program can't go on even if catches it
+    PyErr_SetNone(exception);
+    return -1;
+}
+#endif
 
-            if (PyTrace_LINE==what)                
-                // Notify GUI on line change
-                self->dispatchLineChange();
+int PythonRunThread::python_trace_dispatch(PyObject *context, PyFrameObject *frame, int what, PyObject *arg)
+{
+    PythonRunThread * self = fromContext(context);
+    PyCodeObject * code = frameCode(frame);
+
+    if (PyTrace_CALL==what && !self->codeObjectInfo(code).userCode) {
+        // Library code is executed without line events, but calls
+        // from it back to program code are traced as usual
+#if PY_VERSION_HEX >= 0x030B0000
+        PyObject_SetAttr(reinterpret_cast<PyObject*>(frame), self->traceLinesName_, Py_False);
+#elif PY_VERSION_HEX >= 0x03070000
+        frame->f_trace_lines = 0;
+#endif
+    }
 
-            if (!self->runMode_.isEmpty()) {
-                RunInterface::RunMode mode = self->runMode_.last();
-                if (RunInterface::RM_StepOver==mode || RunInterface::RM_StepIn==mode) {
-                    self->updateDebuggerVariablesModel(frame);
-                }
-            }
+    PyObject * exception = PyTrace_EXCEPTION==what ? PyTuple_GetItem(arg, 1) : 0;
+    return self->dispatchEvent(frame, code, what, exception);
+}
 
+int PythonRunThread::dispatchEvent(PyFrameObject *frame, PyCodeObject *code, int what, PyObject *exception)
+{
+    // This function is called for each Python event, so it must not
+    // lock or allocate anything unless something interesting happens
+    CodeObjectInfo & codeInfo = codeObjectInfo(code);
 
-            if (PyTrace_LINE==what && !self->runMode_.isEmpty()) {
-                RunInterface::RunMode mode = self->runMode_.last();
-                bool stopOnStep = RunInterface::RM_StepOver==mode || RunInterface::RM_StepIn==mode;
-                bool stopOnBreakpoint = RunInterface::RM_Blind!=mode && RunInterface::RM_Idle!=mode
-                        && self->checkForBreakpoint(BreakpointLocation(fileName, lineNumber));
-                if (stopOnStep || stopOnBreakpoint) {
-                    if (RunInterface::RM_Regular==mode)  // not emited while in dispatchLineChange()
-                        Q_EMIT self->lineChanged(lineNumber, 0, 0);
-                    Q_EMIT self->stopped(RunInterface::SR_UserInteraction);
-                    self->runPauseSemaphore_->acquire();
-                }
-            }
+    if (codeInfo.userCode) {
 
+        if (PyTrace_CALL==what) {
+            userFrameDepth_ ++;
+        }
 
-            if (PyTrace_CALL==what) {
-                RunInterface::RunMode curMode = RunInterface::RM_StepOver;
-                if (!self->runMode_.isEmpty())
-                    curMode = self->runMode_.top();
-                RunInterface::RunMode nextMode;
-                if (RunInterface::RM_Blind == curMode || RunInterface::RM_Regular == curMode)
-                    nextMode = curMode;
-                else if (RunInterface::RM_StepIn == curMode)
-                    nextMode = RunInterface::RM_StepOver;
-                else
-                    nextMode = RunInterface::RM_StepOut;
-                self->runMode_.push(curMode==RunInterface::RM_StepIn ? RunInterface::RM_StepOver : RunInterface::RM_Regular);
+        int lineNumber = PyFrame_GetLineNumber(frame) - 1;
+        lineNumber_.storeRelease(lineNumber);
+
+        if (PyTrace_LINE==what || PyTrace_CALL==what || PyTrace_C_CALL==what) {
+            // Program not broken, so clear possible previous error flag
+            Py_CLEAR(pendingException_);
+            if (hasErrorText_.loadAcquire()) {
+                mutex_->lock();
+                errorText_.clear();
+                hasErrorText_.storeRelease(0);
+                mutex_->unlock();
             }
+        }
 
-            if (PyTrace_RETURN==what && !self->runMode_.isEmpty()) {
-                self->runMode_.pop();
-            }
+        if (PyTrace_LINE==what && requestedMode_.load() != activeMode_) {
+            // Changed by GUI thread while running
+            applyRequestedMode();
+        }
 
-            if (PyTrace_EXCEPTION==what || PyTrace_C_EXCEPTION==what) {
-                // Set error status
-                PyObject * exception = PyTuple_GetItem(arg, 1);
-                PyObject * message = PyObject_Str(exception);
-                self->mutex_->lock();
-                self->errorText_ = PyUnicodeToQString(message);
-                self->mutex_->unlock();
-                Py_XDECREF(message);
+        if (PyTrace_LINE==what)
+            // Notify GUI on line change
+            dispatchLineChange();
+
+        if (profiling_ && PyTrace_LINE==what)
+            profileLine(code, lineNumber);
+
+        if (recording_ && PyTrace_LINE==what)
+            executionRecording_.recordLine(frame, lineNumber, userFrameDepth_);
+
+        if (covering_ && PyTrace_LINE==what)
+            coverLine(codeInfo, lineNumber);
+
+        if (PyTrace_LINE==what) {
+            const RunInterface::RunMode mode = activeMode_;
+            const bool stopOnStep = RunInterface::RM_StepIn==mode
+                    || (RunInterface::RM_StepOver==mode && userFrameDepth_ <= targetDepth_)
+                    || (RunInterface::RM_StepOut==mode && userFrameDepth_ < targetDepth_);
+            const bool stopOnBreakpoint = RunInterface::RM_Blind!=mode && RunInterface::RM_Idle!=mode
+                    && checkForBreakpoint(frame, codeInfo, lineNumber);
+            if (stopOnStep || stopOnBreakpoint) {
+                if (RunInterface::RM_Regular==mode)  // not emited while in dispatchLineChange()
+                    notifyLineChanged(lineNumber);
+                canStepOut_.storeRelease(userFrameDepth_ > 1);
+                updateDebuggerVariablesModel(frame);
+                paused_.storeRelease(1);
+                Q_EMIT stopped(RunInterface::SR_UserInteraction);
+                runPauseSemaphore_->acquire();
+                applyRequestedMode();
             }
         }
+
+        if (PyTrace_RETURN==what) {
+            userFrameDepth_ --;
+        }
+
+        if (PyTrace_EXCEPTION==what && exception) {
+            // Most exceptions are caught by program, so error
+            // message is formatted only if this one escapes
+            PyObject * previous = pendingException_;
+            Py_INCREF(exception);
+            pendingException_ = exception;
+            Py_XDECREF(previous);
+        }
+    }
+
+    if (hasForcedGlobalValues_.loadAcquire()) {
+        applyForcedGlobalValues(frameGlobals(frame));
+    }
+
+    if (hasRunLimits_.loadAcquire() && 0 == --limitsCheckCountdown_) {
+        limitsCheckCountdown_ = LimitsCheckInterval;
+        const int limit = exceededRunLimit();
+        if (NoLimitExceeded != limit && limitExceeded_.testAndSetOrdered(NoLimitExceeded, limit)) {
+            stopping_.storeRelease(1);
+        }
+    }
+
+    const bool mustStop = stopping_.loadAcquire();
+    if (mustStop) {
+        const int limit = limitExceeded_.loadAcquire();
+        if (NoLimitExceeded != limit) {
+            PyErr_SetString(PyExc_SystemError, limitExceededMessage(limit).toUtf8().constData());
+        }
         else {
-            // not same file
-            self->mutex_->lock();
-            if (!self->runMode_.isEmpty() && RunInterface::RM_StepIn==self->runMode_.top()) {
-                self->runMode_.top() = RunInterface::RM_StepOver;
+            PyErr_SetString(PyExc_SystemError, "program terminated by user");
+        }
+    }
+    return mustStop;
+}
+
+
+void PythonRunThread::startTracing()
+{
+    traced_ = true;
+    // Tracing might be started while program running, and returns of
+    // program frames already entered are traced, so count them in depth
+    userFrameDepth_ = 0;
+    for (PyFrameObject * frame = PyEval_GetFrame(); frame; frame = frameBack(frame)) {
+        if (codeObjectInfo(frameCode(frame)).userCode) {
+            userFrameDepth_ ++;
+        }
+    }
+    targetDepth_ = userFrameDepth_;
+#if PY_VERSION_HEX >= 0x030C0000
+    if (startMonitoring()) {
+        return;
+    }
+#endif
+#if PY_VERSION_HEX >= 0x030B0000
+    if (!traceLinesName_) {
+        traceLinesName_ = PyUnicode_InternFromString("f_trace_lines");
+    }
+#endif
+    // Trace function is given this run thread as its argument
+    PyObject * context = PyCapsule_New(this, 0, 0);
+    PyEval_SetTrace(&python_trace_dispatch, context);
+    Py_DECREF(context);
+}
+
+void PythonRunThread::stopTracing()
+{
+#if PY_VERSION_HEX >= 0x030C0000
+    stopMonitoring();
+#endif
+    PyEval_SetTrace(0, 0);
+#if PY_VERSION_HEX >= 0x030B0000
+    Py_CLEAR(traceLinesName_);
+#endif
+    traced_ = false;
+}
+
+#if PY_VERSION_HEX >= 0x030C0000
+
+// sys.monitoring.DEBUGGER_ID
+static const int MonitoringToolId = 0;
+
+static long monitoringEvent(PyObject * events, const char * name)
+{
+    PyObject * value = PyObject_GetAttrString(events, name);
+    const long result = value ? PyLong_AsLong(value) : 0;
+    Py_XDECREF(value);
+    return result;
+}
+
+static void discardMonitoringResult(PyObject * result)
+{
+    if (result) {
+        Py_DECREF(result);
+    }
+    else {
+        PyErr_Clear();
+    }
+}
+
+bool PythonRunThread::startMonitoring()
+{
+    static PyMethodDef Callbacks[] = {
+        { "kumir_py_start", reinterpret_cast<PyCFunction>(reinterpret_cast<void(*)(void)>(&monitoring_py_start)), METH_FASTCALL, 0 },
+        { "kumir_py_return", reinterpret_cast<PyCFunction>(reinterpret_cast<void(*)(void)>(&monitoring_py_return)), METH_FASTCALL, 0 },
+        { "kumir_py_unwind", reinterpret_cast<PyCFunction>(reinterpret_cast<void(*)(void)>(&monitoring_py_unwind)), METH_FASTCALL, 0 },
+        { "kumir_line", reinterpret_cast<PyCFunction>(reinterpret_cast<void(*)(void)>(&monitoring_line)), METH_FASTCALL, 0 },
+        { "kumir_raise", reinterpret_cast<PyCFunction>(reinterpret_cast<void(*)(void)>(&monitoring_raise)), METH_FASTCALL, 0 }
+    };
+
+    PyObject * sys = PyImport_ImportModule("sys");
+    PyObject * monitoring = sys ? PyObject_GetAttrString(sys, "monitoring") : 0;
+    Py_XDECREF(sys);
+    if (!monitoring) {
+        PyErr_Clear();
+        return false;
+    }
+    // Tool might be already in use by some debugger, so
+    // fall back to legacy tracing in this case
+    PyObject * result = PyObject_CallMethod(monitoring, "use_tool_id", "is", MonitoringToolId, "kumir2");
+    if (!result) {
+        PyErr_Clear();
+        Py_DECREF(monitoring);
+        return false;
+    }
+    Py_DECREF(result);
+
+    PyObject * events = PyObject_GetAttrString(monitoring, "events");
+    const long pyStart = monitoringEvent(events, "PY_START");
+    const long pyResume = monitoringEvent(events, "PY_RESUME");
+    const long pyReturn = monitoringEvent(events, "PY_RETURN");
+    const long pyYield = monitoringEvent(events, "PY_YIELD");
+    const long pyUnwind = monitoringEvent(events, "PY_UNWIND");
+    const long line = monitoringEvent(events, "LINE");
+    const long raise = monitoringEvent(events, "RAISE");
+    Py_DECREF(events);
+
+    const QList< QPair<long,PyMethodDef*> > registrations = QList< QPair<long,PyMethodDef*> >()
+            << qMakePair(pyStart, &Callbacks[0]) << qMakePair(pyResume, &Callbacks[0])
+            << qMakePair(pyReturn, &Callbacks[1]) << qMakePair(pyYield, &Callbacks[1])
+            << qMakePair(pyUnwind, &Callbacks[2])
+            << qMakePair(line, &Callbacks[3])
+            << qMakePair(raise, &Callbacks[4]);
+    PyObject * context = PyCapsule_New(this, 0, 0);
+    for (int i=0; i<registrations.size(); i++) {
+        PyObject * callback = PyCFunction_New(registrations[i].second, context);
+        discardMonitoringResult(PyObject_CallMethod(monitoring, "register_callback", "ilO",
+                                                    MonitoringToolId, registrations[i].first, callback));
+        Py_DECREF(callback);
+    }
+    Py_DECREF(context);
+
+    // Calls and exceptions are monitored everywhere, but library code
+    // disables its events on first call. Line events are enabled
+    // for program code objects only
+    discardMonitoringResult(PyObject_CallMethod(monitoring, "set_events", "il",
+                                                MonitoringToolId, pyStart | pyResume | pyUnwind | raise));
+    monitoring_ = monitoring;
+    monitoringDisable_ = PyObject_GetAttrString(monitoring, "DISABLE");
+    monitoringLocalEvents_ = line | pyReturn | pyYield;
+
+    // Tracing might be started while program running,
+    // so enable line events for program code already entered
+    QHash<PyCodeObject*,CodeObjectInfo>::const_iterator it;
+    for (it=codeObjects_.constBegin(); it!=codeObjects_.constEnd(); ++it) {
+        if (it.value().userCode) {
+            enableLocalMonitoring(it.key());
+        }
+    }
+    return true;
+}
+
+void PythonRunThread::stopMonitoring()
+{
+    if (!monitoring_) {
+        return;
+    }
+    // Events disabled for covered program lines need no restart: only
+    // marshalled code is cached, so next run unmarshals new code objects
+    // in new interpreter, while these ones end with this interpreter
+    discardMonitoringResult(PyObject_CallMethod(monitoring_, "set_events", "ii", MonitoringToolId, 0));
+    QHash<PyCodeObject*,CodeObjectInfo>::const_iterator it;
+    for (it=codeObjects_.constBegin(); it!=codeObjects_.constEnd(); ++it) {
+        if (it.value().userCode) {
+            discardMonitoringResult(PyObject_CallMethod(monitoring_, "set_local_events", "iOi",
+                                                        MonitoringToolId, it.key(), 0));
+        }
+    }
+    discardMonitoringResult(PyObject_CallMethod(monitoring_, "free_tool_id", "i", MonitoringToolId));
+    Py_CLEAR(monitoringDisable_);
+    Py_CLEAR(monitoring_);
+}
+
+void PythonRunThread::enableLocalMonitoring(PyCodeObject *code)
+{
+    discardMonitoringResult(PyObject_CallMethod(monitoring_, "set_local_events", "iOl",
+                                                MonitoringToolId, code, monitoringLocalEvents_));
+}
+
+PyObject* PythonRunThread::dispatchMonitoringEvent(PyObject *code, int what, PyObject *exception, bool canDisable)
+{
+    PyCodeObject * codeObject = reinterpret_cast<PyCodeObject*>(code);
+    const bool userCode = codeObjectInfo(codeObject).userCode;
+    PyFrameObject * frame = PyEval_GetFrame();
+    if (!frame || (!userCode && !canDisable)) {
+        // Exception passes through library code
+        Py_RETURN_NONE;
+    }
+    if (dispatchEvent(frame, codeObject, what, exception)) {
+        return 0;
+    }
+    if (!userCode || (coverageOnly_ && PyTrace_LINE==what)) {
+        // Do not call again for this location of library code,
+        // or for program line already covered
+        Py_INCREF(monitoringDisable_);
+        return monitoringDisable_;
+    }
+    Py_RETURN_NONE;
+}
+
+PyObject* PythonRunThread::monitoring_py_start(PyObject *context, PyObject *const *args, Py_ssize_t)
+{
+    return fromContext(context)->dispatchMonitoringEvent(args[0], PyTrace_CALL, 0, true);
+}
+
+PyObject* PythonRunThread::monitoring_py_return(PyObject *context, PyObject *const *args, Py_ssize_t)
+{
+    return fromContext(context)->dispatchMonitoringEvent(args[0], PyTrace_RETURN, 0, true);
+}
+
+PyObject* PythonRunThread::monitoring_py_unwind(PyObject *context, PyObject *const *args, Py_ssize_t)
+{
+    return fromContext(context)->dispatchMonitoringEvent(args[0], PyTrace_RETURN, 0, false);
+}
+
+PyObject* PythonRunThread::monitoring_line(PyObject *context, PyObject *const *args, Py_ssize_t)
+{
+    return fromContext(context)->dispatchMonitoringEvent(args[0], PyTrace_LINE, 0, true);
+}
+
+PyObject* PythonRunThread::monitoring_raise(PyObject *context, PyObject *const *args, Py_ssize_t)
+{
+    return fromContext(context)->dispatchMonitoringEvent(args[0], PyTrace_EXCEPTION, args[2], false);
+}
+
+#endif
+
+CodeObjectInfo & PythonRunThread::codeObjectInfo(PyCodeObject *code)
+{
+    QHash<PyCodeObject*,CodeObjectInfo>::iterator it = codeObjects_.find(code);
+    if (it != codeObjects_.end()) {
+        return it.value();
+    }
+    // Code object is referenced while cached, so its address can't be
+    // reused by another one until cache cleared
+    static const QString DummyFileName = QString::fromLatin1("<program>");
+    CodeObjectInfo info;
+    info.fileName = PyUnicodeToQString(code->co_filename);
+    info.userCode = DummyFileName==info.fileName || info.fileName==sourceProgramPath_;
+    info.firstLineNumber = code->co_firstlineno - 1;
+    Py_INCREF(code);
+#if PY_VERSION_HEX >= 0x030C0000
+    if (monitoring_ && info.userCode) {
+        enableLocalMonitoring(code);
+    }
+#endif
+    return codeObjects_.insert(code, info).value();
+}
+
+void PythonRunThread::clearCodeObjectsCache()
+{
+    // Must be called while interpreter lock held
+    Q_FOREACH(PyCodeObject * code, codeObjects_.keys()) {
+        Py_DECREF(code);
+    }
+    codeObjects_.clear();
+    Q_FOREACH(const BreakpointCondition & condition, breakpointConditions_.values()) {
+        Py_XDECREF(condition.code);
+    }
+    breakpointConditions_.clear();
+}
+
+void PythonRunThread::applyForcedGlobalValues(PyObject *globals)
+{
+    // Called for each traced event, so normally does nothing
+    // but checks whether globals dictionary changed
+    const int version = forcedGlobalValuesVersion_.loadAcquire();
+    if (version != forcedGlobalsVersion_) {
+        // Names are interned to be compared by identity
+        // with keys of globals dictionary
+        for (int i=0; i<forcedGlobals_.size(); i++) {
+            Py_DECREF(forcedGlobals_[i].first);
+        }
+        forcedGlobals_.clear();
+        mutex_->lock();
+        QMap<QByteArray,PyObject*>::const_iterator it;
+        for (it=forcedGlobalValues_.constBegin(); it!=forcedGlobalValues_.constEnd(); ++it) {
+            forcedGlobals_.append(qMakePair(PyUnicode_InternFromString(it.key().constData()), it.value()));
+        }
+        mutex_->unlock();
+        forcedGlobalsVersion_ = version;
+        forcedGlobalsChanged_ = true;
+    }
+    if (globals != forcedGlobalsDict_) {
+#if PY_VERSION_HEX >= 0x030C0000
+        if (-1 == forcedGlobalsWatcher_) {
+            forcedGlobalsWatcher_ = PyDict_AddWatcher(&forced_globals_watcher);
+            if (-1 == forcedGlobalsWatcher_) {
+                // All watchers used, so apply values each time
+                PyErr_Clear();
+                forcedGlobalsWatcher_ = -2;
             }
-            self->mutex_->unlock();
-        }
-        self->mutex_->lock();
-        if (!self->forcedGlobalValues_.isEmpty()) {
-            PyObject * globals = frame->f_globals;
-            Q_FOREACH(const QByteArray & forcedName, self->forcedGlobalValues_.keys()) {
-                PyObject * value = self->forcedGlobalValues_[forcedName];
-                PyDict_SetItemString(globals, forcedName.constData(), value);
+        }
+        if (forcedGlobalsWatcher_ >= 0) {
+            if (forcedGlobalsDict_) {
+                PyDict_Unwatch(forcedGlobalsWatcher_, forcedGlobalsDict_);
             }
+            PyDict_Watch(forcedGlobalsWatcher_, globals);
         }
-        self->mutex_->unlock();
+#endif
+        forcedGlobalsDict_ = globals;
+        forcedGlobalsChanged_ = true;
+    }
+#if PY_VERSION_HEX >= 0x030C0000
+    if (!forcedGlobalsChanged_ && forcedGlobalsWatcher_ >= 0) {
+        return;
+    }
+    applyingForcedGlobals_ = true;
+#elif PY_VERSION_HEX >= 0x03060000
+    if (!forcedGlobalsChanged_ && reinterpret_cast<PyDictObject*>(globals)->ma_version_tag == forcedGlobalsDictVersion_) {
+        return;
     }
+#endif
+    for (int i=0; i<forcedGlobals_.size(); i++) {
+        PyDict_SetItem(globals, forcedGlobals_[i].first, forcedGlobals_[i].second);
+    }
+    forcedGlobalsChanged_ = false;
+#if PY_VERSION_HEX >= 0x030C0000
+    applyingForcedGlobals_ = false;
+#elif PY_VERSION_HEX >= 0x03060000
+    forcedGlobalsDictVersion_ = reinterpret_cast<PyDictObject*>(globals)->ma_version_tag;
+#endif
+}
 
-    self->mutex_->lock();
-    mustStop = self->stopping_;
-    self->mutex_->unlock();
+#if PY_VERSION_HEX >= 0x030C0000
+int PythonRunThread::forced_globals_watcher(PyDict_WatchEvent event, PyObject *, PyObject *key, PyObject *)
+{
+    // Watchers are registered per interpreter, so this one belongs
+    // to run thread of current interpreter
+    PythonRunThread * self = current();
+    if (!self) {
+        return 0;
+    }
+    if (self->applyingForcedGlobals_ || self->forcedGlobalsChanged_) {
+        return 0;
+    }
+    if (PyDict_EVENT_ADDED != event && PyDict_EVENT_MODIFIED != event && PyDict_EVENT_DELETED != event) {
+        // Cleared, cloned or deallocated
+        self->forcedGlobalsChanged_ = true;
+        return 0;
+    }
+    for (int i=0; i<self->forcedGlobals_.size(); i++) {
+        PyObject * name = self->forcedGlobals_[i].first;
+        if (key == name || (PyUnicode_Check(key) && 0 == PyUnicode_Compare(key, name))) {
+            self->forcedGlobalsChanged_ = true;
+            break;
+        }
+    }
+    return 0;
+}
+#endif
 
-    if (mustStop) {
-        PyErr_SetString(PyExc_SystemError, "program terminated by user");
+void PythonRunThread::clearForcedGlobalsCache()
+{
+    // Must be called while interpreter lock held, since
+    // watcher and names belong to interpreter
+#if PY_VERSION_HEX >= 0x030C0000
+    if (forcedGlobalsWatcher_ >= 0) {
+        if (forcedGlobalsDict_) {
+            PyDict_Unwatch(forcedGlobalsWatcher_, forcedGlobalsDict_);
+        }
+        PyDict_ClearWatcher(forcedGlobalsWatcher_);
     }
-    return mustStop;
+    forcedGlobalsWatcher_ = -1;
+#endif
+    for (int i=0; i<forcedGlobals_.size(); i++) {
+        Py_DECREF(forcedGlobals_[i].first);
+    }
+    forcedGlobals_.clear();
+    forcedGlobalsVersion_ = -1;
+    forcedGlobalsDict_ = 0;
+    forcedGlobalsChanged_ = true;
+}
+
+void PythonRunThread::applyRequestedMode()
+{
+    // Stepping over stops at depth of current frame or less,
+    // and stepping out stops at less depth only
+    activeMode_ = RunInterface::RunMode(requestedMode_.loadAcquire());
+    targetDepth_ = userFrameDepth_;
 }
 
+class ProgramInterrupter : public QRunnable
+{
+public:
+    inline explicit ProgramInterrupter(PythonRunThread * runner): runner_(runner) {}
+    inline void run() { runner_->interruptProgram(); }
+private:
+    PythonRunThread * runner_;
+};
+
 void PythonRunThread::terminate()
 {
-    mutex_->lock();
-    stopping_ = true;
-    mutex_->unlock();
+    stopping_.storeRelease(1);
+    releaseSemaphores();
+    if (!isRunning()) {
+        return;
+    }
+    terminateRequestTime_.testAndSetOrdered(-1, clock_.elapsed());
+    // Acquiring interpreter lock might take a while, so
+    // do not block GUI thread
+    QThreadPool::globalInstance()->start(new ProgramInterrupter(this));
+    // Exception might be caught by program or not raised yet
+    // while program is in C call, so repeat until stopped
+    terminateTimer_->start();
+}
 
+void PythonRunThread::repeatTerminate()
+{
+    if (!isRunning()) {
+        terminateTimer_->stop();
+        return;
+    }
     releaseSemaphores();
+    QThreadPool::globalInstance()->start(new ProgramInterrupter(this));
 }
 
-void PythonRunThread::dispatchLineChange()
+void PythonRunThread::interruptProgram()
 {
-    mutex_->lock();
-    RunInterface::RunMode currentMode = RunInterface::RM_Regular;
-    if (!runMode_.isEmpty())
-        currentMode = runMode_.top();
-    bool emitSteps = RunInterface::RM_StepOver==currentMode || RunInterface::RM_StepIn==currentMode || RunInterface::RM_StepOut==currentMode;
-    bool justStarted = false;
-    unsigned long int stepsCounter = 0;
-    int lineNumber = lineNumber_;
-    emitSteps = emitSteps || justStarted_;
-    if (!justStarted_) {
-        stepsCounted_++;
-        stepsCounter = stepsCounted_;
-        emitSteps = emitSteps || 0==stepsCounter%1000;
+    QMutexLocker l(interruptMutex_);
+    if (!programThreadState_) {
+        return;
     }
-    else {
-        justStarted = true;
+    // Raise an exception asynchronously in program thread, so it is
+    // checked by interpreter loop rather than by trace function.
+    // Pending calls are not suitable here since they are run by
+    // main thread only
+    PyThreadState * ts = PyThreadState_New(programThreadState_->interp);
+    PyEval_AcquireThread(ts);
+    PyThreadState_SetAsyncExc(programThreadState_->thread_id, terminatedException_);
+    if (++interruptsCount_ > InterruptsBeforeEscalation) {
+        // Program keeps running, so exception was caught
+#if PY_VERSION_HEX >= 0x030C0000
+        // Set trace function raising it at every event of each thread
+        // of program interpreter, this one included
+        PyEval_SetTraceAllThreads(&python_terminate_dispatch, terminatedException_);
+#else
+        // Trace function can be set for the current thread only. Traced
+        // program fails at every event once stopping, see dispatchEvent(),
+        // and untraced one gets the exception repeated until finished
+#endif
+    }
+    PyThreadState_Clear(ts);
+    PyThreadState_DeleteCurrent();
+}
+
+void PythonRunThread::storeEscapedException()
+{
+    PyObject * type = 0;
+    PyObject * value = 0;
+    PyObject * traceback = 0;
+    PyErr_Fetch(&type, &value, &traceback);
+    PyErr_NormalizeException(&type, &value, &traceback);
+    int lineNumber = -1;
+    for (PyTracebackObject * tb = reinterpret_cast<PyTracebackObject*>(traceback);
+         tb; tb = tb->tb_next)
+    {
+        if (codeObjectInfo(frameCode(tb->tb_frame)).userCode) {
+            lineNumber = tb->tb_lineno - 1;
+        }
+    }
+    PyObject * message = value ? PyObject_Str(value) : 0;
+    mutex_->lock();
+    errorText_ = message ? PyUnicodeToQString(message) : QString::fromLatin1("error");
+    hasErrorText_.storeRelease(1);
+    if (-1 != lineNumber) {
+        lineNumber_.storeRelease(lineNumber);
     }
-    justStarted_ = false;
     mutex_->unlock();
-    if (justStarted) {
-        Q_EMIT updateStepsCounter(0);
+    Py_XDECREF(message);
+    Py_XDECREF(type);
+    Py_XDECREF(value);
+    Py_XDECREF(traceback);
+}
+
+void PythonRunThread::formatPendingException()
+{
+    // Must be called while interpreter lock held
+    if (!pendingException_) {
+        return;
     }
-    else if (emitSteps) {
-        Q_EMIT updateStepsCounter(stepsCounter);
+    PyObject * exception = pendingException_;
+    pendingException_ = 0;
+    // Exception might be still set as current one
+    PyObject * type = 0;
+    PyObject * value = 0;
+    PyObject * traceback = 0;
+    PyErr_Fetch(&type, &value, &traceback);
+    PyObject * message = PyObject_Str(exception);
+    mutex_->lock();
+    errorText_ = message ? PyUnicodeToQString(message) : QString::fromLatin1("error");
+    hasErrorText_.storeRelease(1);
+    mutex_->unlock();
+    Py_XDECREF(message);
+    Py_DECREF(exception);
+    PyErr_Restore(type, value, traceback);
+}
+
+void PythonRunThread::dispatchLineChange()
+{
+    const RunInterface::RunMode currentMode = activeMode_;
+    // Counter is only sampled by GUI timer, so no ordering required
+    if (!justStarted_) {
+        stepsCounted_.fetchAndAddRelaxed(1);
     }
+    justStarted_ = false;
 
     // Highlight current line if need
     if (RunInterface::RM_StepOver==currentMode || RunInterface::RM_StepIn==currentMode || RunInterface::RM_StepOut==currentMode) {
-        Q_EMIT lineChanged(lineNumber, 0, 0);
+        notifyLineChanged(lineNumber_.loadAcquire());
+    }
+
+}
+
+void PythonRunThread::setRunLimits(const RunLimits &limits)
+{
+    QMutexLocker l(mutex_);
+    runLimits_ = limits;
+}
+
+qint64 PythonRunThread::runThreadCpuTime() const
+{
+    // Might be called from any thread, returns -1 if not available
+#if defined(Q_OS_WIN32)
+    FILETIME creationTime, exitTime, kernelTime, userTime;
+    if (runThreadHandle_ && GetThreadTimes(runThreadHandle_, &creationTime, &exitTime, &kernelTime, &userTime)) {
+        const quint64 kernel = (quint64(kernelTime.dwHighDateTime) << 32) | kernelTime.dwLowDateTime;
+        const quint64 user = (quint64(userTime.dwHighDateTime) << 32) | userTime.dwLowDateTime;
+        return qint64((kernel + user) / 10000);
+    }
+#elif defined(Q_OS_UNIX) && !defined(Q_OS_MAC)
+    struct timespec ts;
+    if (runThreadCpuClockValid_ && 0 == clock_gettime(runThreadCpuClock_, &ts)) {
+        return qint64(ts.tv_sec) * 1000 + ts.tv_nsec / 1000000;
+    }
+#endif
+    return -1;
+}
+
+int PythonRunThread::exceededRunLimit() const
+{
+    // Active limits are not changed while running, so no lock required
+    if (activeRunLimits_.steps && stepsCounted_.load() >= activeRunLimits_.steps) {
+        return StepsLimitExceeded;
+    }
+    if (runningParallelIterations_.loadAcquire()) {
+        return NoLimitExceeded;
+    }
+    if (activeRunLimits_.wallTime && clock_.elapsed() - iterationStartTime_.loadAcquire() >= activeRunLimits_.wallTime) {
+        return WallTimeLimitExceeded;
+    }
+    if (activeRunLimits_.cpuTime) {
+        const qint64 cpuTime = runThreadCpuTime();
+        const qint64 startCpuTime = iterationStartCpuTime_.loadAcquire();
+        if (cpuTime >= 0 && startCpuTime >= 0 && cpuTime - startCpuTime >= activeRunLimits_.cpuTime) {
+            return CpuTimeLimitExceeded;
+        }
+    }
+    return NoLimitExceeded;
+}
+
+void PythonRunThread::checkRunLimits()
+{
+    // Watchdog for programs running without trace function,
+    // or stuck in long library call
+    const int limit = exceededRunLimit();
+    if (NoLimitExceeded != limit && limitExceeded_.testAndSetOrdered(NoLimitExceeded, limit)) {
+        qDebug() << "Run limit exceeded: " << limitExceededMessage(limit);
+        limitsTimer_->stop();
+        terminate();
+    }
+}
+
+QString PythonRunThread::limitExceededMessage(int limit)
+{
+    switch (limit) {
+    case StepsLimitExceeded: return tr("Steps limit exceeded");
+    case WallTimeLimitExceeded: return tr("Time limit exceeded");
+    case CpuTimeLimitExceeded: return tr("CPU time limit exceeded");
+    case MemoryLimitExceeded: return tr("Memory limit exceeded");
+    default: return QString();
     }
+}
+
+void PythonRunThread::startProfiling()
+{
+    lineProfileData_.clear();
+    profiledLine_ = -1;
+    profileTimer_.start();
+    profiling_ = true;
+}
 
+void PythonRunThread::profileLine(PyCodeObject *code, int lineNumber)
+{
+    // Time between line events belongs to previous line, including
+    // library functions called from it which have no line events
+    const qint64 now = profileTimer_.nsecsElapsed();
+    if (-1 != profiledLine_) {
+        lineProfileData_[profiledLine_].nsecs += now - profiledLineStart_;
+    }
+    LineProfile & line = lineProfileData_[lineNumber];
+    if (0 == line.hits) {
+        line.function = PyUnicodeToQString(code->co_name);
+    }
+    line.hits ++;
+    profiledLine_ = lineNumber;
+    profiledLineStart_ = now;
 }
 
-bool PythonRunThread::checkForBreakpoint(const BreakpointLocation &location)
+void PythonRunThread::finishProfiling()
 {
+    profiling_ = false;
+    if (-1 != profiledLine_) {
+        lineProfileData_[profiledLine_].nsecs += profileTimer_.nsecsElapsed() - profiledLineStart_;
+    }
+    QMutexLocker l(mutex_);
+    lineProfile_ = lineProfileData_;
+}
+
+void PythonRunThread::findCoverableLines(PyObject *code)
+{
+    // Lines having bytecode in program and its nested code objects
+    PyObject * dis = PyImport_ImportModule("dis");
+    if (!dis) {
+        PyErr_Clear();
+        return;
+    }
+    QList<PyObject*> codes;
+    codes.append(code);
+    while (!codes.isEmpty()) {
+        PyObject * current = codes.takeLast();
+        PyObject * starts = PyObject_CallMethod(dis, "findlinestarts", "O", current);
+        PyObject * iterator = starts ? PyObject_GetIter(starts) : 0;
+        PyObject * item = 0;
+        while (iterator && (item = PyIter_Next(iterator))) {
+            // Line might be None for artificial instructions
+            PyObject * line = PyTuple_Check(item) && 2 == PyTuple_Size(item) ? PyTuple_GetItem(item, 1) : 0;
+            if (line && PyLong_Check(line)) {
+                const int lineNumber = int(PyLong_AsLong(line)) - 1;
+                if (lineNumber >= 0) {
+                    if (lineNumber >= coverableLines_.size()) {
+                        coverableLines_.resize(lineNumber + 1);
+                    }
+                    coverableLines_.setBit(lineNumber);
+                }
+            }
+            Py_DECREF(item);
+        }
+        Py_XDECREF(iterator);
+        Py_XDECREF(starts);
+        PyErr_Clear();
+        PyObject * consts = reinterpret_cast<PyCodeObject*>(current)->co_consts;
+        for (Py_ssize_t i=0; i<PyTuple_Size(consts); i++) {
+            if (PyCode_Check(PyTuple_GetItem(consts, i))) {
+                codes.append(PyTuple_GetItem(consts, i));
+            }
+        }
+    }
+    Py_DECREF(dis);
+}
+
+void PythonRunThread::coverLine(CodeObjectInfo &codeInfo, int lineNumber)
+{
+    const int index = lineNumber - codeInfo.firstLineNumber;
+    if (index < 0) {
+        return;
+    }
+    if (index >= codeInfo.coveredLines.size()) {
+        codeInfo.coveredLines.resize(index + 1);
+    }
+    codeInfo.coveredLines.setBit(index);
+}
+
+void PythonRunThread::collectCoverage()
+{
+    // Code objects are not kept between iterations, so their
+    // lines are merged before interpreter ends
+    QHash<PyCodeObject*,CodeObjectInfo>::const_iterator it;
+    for (it=codeObjects_.constBegin(); it!=codeObjects_.constEnd(); ++it) {
+        const CodeObjectInfo & info = it.value();
+        if (!info.userCode) {
+            continue;
+        }
+        for (int i=0; i<info.coveredLines.size(); i++) {
+            if (!info.coveredLines.testBit(i)) {
+                continue;
+            }
+            const int lineNumber = info.firstLineNumber + i;
+            if (lineNumber >= lineCoverageData_.size()) {
+                lineCoverageData_.resize(lineNumber + 1);
+            }
+            lineCoverageData_.setBit(lineNumber);
+        }
+    }
+}
+
+void PythonRunThread::finishCoverage()
+{
+    QMutexLocker l(mutex_);
+    if (!coverageMode_) {
+        return;
+    }
+    QMap<int,bool> coverage;
+    for (int i=0; i<coverableLines_.size(); i++) {
+        if (coverableLines_.testBit(i)) {
+            coverage[i] = i < lineCoverageData_.size() && lineCoverageData_.testBit(i);
+        }
+    }
+    for (int i=0; i<lineCoverageData_.size(); i++) {
+        if (lineCoverageData_.testBit(i)) {
+            coverage[i] = true;
+        }
+    }
+    lineCoverage_ = coverage;
+}
+
+bool PythonRunThread::stepBackward()
+{
+    return moveInRecording(true);
+}
+
+bool PythonRunThread::stepForward()
+{
+    return moveInRecording(false);
+}
+
+bool PythonRunThread::moveInRecording(bool backward)
+{
+    // Recording is changed by run thread unless it waits for resume
+    if (isRunning() && !paused_.loadAcquire()) {
+        return false;
+    }
+    const bool moved = backward ? executionRecording_.stepBack() : executionRecording_.stepForward();
+    if (!moved) {
+        return false;
+    }
+    const int lineNumber = executionRecording_.lineNumber();
+    lineNumber_.storeRelease(lineNumber);
+    variablesModel_->update(executionRecording_.globals(), executionRecording_.locals());
+    Q_EMIT lineChanged(lineNumber, 0, 0);
+    return true;
+}
+
+void PythonRunThread::notifyLineChanged(int lineNumber)
+{
+    // Only the latest line is delivered if GUI thread is busy
+    // with previous notifications
+    pendingLineNumber_.storeRelease(lineNumber);
+    if (lineChangePending_.testAndSetOrdered(0, 1)) {
+        QMetaObject::invokeMethod(this, "deliverLineChange", Qt::QueuedConnection);
+    }
+}
+
+void PythonRunThread::deliverLineChange()
+{
+    lineChangePending_.storeRelease(0);
+    Q_EMIT lineChanged(pendingLineNumber_.loadAcquire(), 0, 0);
+}
+
+void PythonRunThread::sampleStepsCounter()
+{
+    const quint64 steps = stepsCounted_.load();
+    if (steps != stepsReported_) {
+        stepsReported_ = steps;
+        Q_EMIT updateStepsCounter(steps);
+    }
+}
+
+void PythonRunThread::setStepsCounterInterval(int msec)
+{
+    stepsTimer_->setInterval(msec > 0 ? msec : DefaultStepsCounterInterval);
+}
+
+bool PythonRunThread::checkForBreakpoint(PyFrameObject *frame, CodeObjectInfo &codeInfo, int lineNumber)
+{
+    if (!hasBreakpoints_.loadAcquire()) {
+        return false;
+    }
+
+    // Breakpoint lines are resolved to code object once
+    // per breakpoints change, so most lines are checked by one bit test
+    if (codeInfo.breakpointsVersion != breakpointsVersion_.loadAcquire()) {
+        updateBreakpointLines();
+        codeInfo.breakpointLines = breakpointLines_.value(codeInfo.fileName);
+        codeInfo.breakpointsVersion = breakpointLinesVersion_;
+    }
+    if (lineNumber < 0 || lineNumber >= codeInfo.breakpointLines.size()
+            || !codeInfo.breakpointLines.testBit(lineNumber))
+    {
+        return false;
+    }
+
+    const BreakpointLocation location(codeInfo.fileName, lineNumber);
+    QString condition;
+    mutex_->lock();
     if (singleHits_.contains(location)) {
         singleHits_.remove(location);
+        hasBreakpoints_.storeRelease(!breakpoints_.isEmpty() || !singleHits_.isEmpty());
+        breakpointsVersion_.fetchAndAddRelease(1);
+        mutex_->unlock();
         return true;
     }
-    else {
-        return breakpoints_.contains(location); // TODO: 1) check condition; 2) check hit count
+    if (breakpoints_.contains(location)) {
+        condition = breakpoints_[location].condition.trimmed();
+    }
+    mutex_->unlock();
+
+    // Condition is Python code, so evaluated without lock held
+    if (!condition.isEmpty() && !evaluateBreakpointCondition(frame, location, condition)) {
+        return false;
     }
+
+    QMutexLocker l(mutex_);
+    QMap<BreakpointLocation,BreakpointData>::iterator it = breakpoints_.find(location);
+    if (it == breakpoints_.end()) {
+        return false;
+    }
+    it.value().hitCount ++;
+    return it.value().hitCount > it.value().ignoreCount;
+}
+
+void PythonRunThread::updateBreakpointLines()
+{
+    const int version = breakpointsVersion_.loadAcquire();
+    if (version == breakpointLinesVersion_) {
+        return;
+    }
+    QMutexLocker l(mutex_);
+    breakpointLines_.clear();
+    QList<BreakpointLocation> locations = singleHits_.toList();
+    QMap<BreakpointLocation,BreakpointData>::const_iterator it;
+    for (it=breakpoints_.constBegin(); it!=breakpoints_.constEnd(); ++it) {
+        if (it.value().enabled) {
+            locations.append(it.key());
+        }
+    }
+    Q_FOREACH(const BreakpointLocation & location, locations) {
+        QBitArray & lines = breakpointLines_[location.first];
+        const int lineNumber = int(location.second);
+        if (lines.size() <= lineNumber) {
+            lines.resize(lineNumber + 1);
+        }
+        lines.setBit(lineNumber);
+    }
+    breakpointLinesVersion_ = version;
+}
+
+bool PythonRunThread::evaluateBreakpointCondition(PyFrameObject *frame, const BreakpointLocation &location, const QString &condition)
+{
+    // Condition compiled once and then evaluated in breakpoint frame.
+    // Invalid condition or evaluation error stops program to let user see it
+    BreakpointCondition & compiled = breakpointConditions_[location];
+    if (compiled.source != condition) {
+        Py_XDECREF(compiled.code);
+        compiled.source = condition;
+        compiled.code = compileModule(QString::fromLatin1("<condition>"), condition, 0, 0, Py_eval_input);
+        if (!compiled.code) {
+            qDebug() << "Invalid breakpoint condition: " << condition;
+            PyErr_Clear();
+        }
+    }
+    if (!compiled.code) {
+        return true;
+    }
+    PyObject * globals = frameGlobals(frame);
+    PyObject * locals = frameLocals(frame);
+    PyObject * result = PyEval_EvalCode(compiled.code, globals, locals ? locals : globals);
+    Py_XDECREF(locals);
+    int value = result ? PyObject_IsTrue(result) : -1;
+    Py_XDECREF(result);
+    if (value < 0) {
+        PyErr_Clear();
+        value = 1;
+    }
+    return value;
 }
 
 
@@ -509,18 +1643,188 @@ void PythonRunThread::updateDebuggerVariablesModel(PyFrameObject *current_frame)
 void PythonRunThread::startOrContinue(const RunInterface::RunMode runMode)
 {    
     if (!isRunning()) {
-        runMode_.clear();
-        runMode_.push(RunInterface::RM_StepOver==runMode? RunInterface::RM_StepIn : runMode);
+        requestedMode_.storeRelease(RunInterface::RM_StepOver==runMode? RunInterface::RM_StepIn : runMode);
         actorsHandler_->resetActors();
+        limitExceeded_.storeRelease(NoLimitExceeded);
+        peakMemory_.store(0);
+        mutex_->lock();
+        activeRunLimits_ = testingMode_ ? runLimits_ : RunLimits();
+        mutex_->unlock();
+        const bool limited = activeRunLimits_.isSet();
+        hasRunLimits_.storeRelease(limited);
+        if (limited) {
+            limitsTimer_->start();
+        }
+        stepsReported_ = 0;
+        Q_EMIT updateStepsCounter(0);
+        stepsTimer_->start();
         start();
     }
     else {
-        if (runMode_.isEmpty())
-            runMode_.push(runMode);
-        else
-            runMode_.top() = runMode;
-        runPauseSemaphore_->release();
+        requestedMode_.storeRelease(runMode);
+        // Program is resumed if paused, otherwise new mode
+        // is applied by run thread at next line
+        if (paused_.testAndSetOrdered(1, 0)) {
+            runPauseSemaphore_->release();
+        }
+    }
+}
+
+bool PythonRunThread::runParallelTestIterations(quint32 count)
+{
+    // Iterations are independent, so split them between worker processes,
+    // one per core. Worker runs __pre_run__, program and __post_run__ with
+    // pure Python _kumir module, see test_worker.py
+    const int workersCount = qMax(1, qMin(QThread::idealThreadCount(), int(count)));
+    QList<QVariantList> runsLeft;
+    for (int i=0; i<workersCount; i++) {
+        runsLeft.append(QVariantList());
+    }
+    for (quint32 i=0; i<count; i++) {
+        // The current iteration is already done here, the last one is left
+        runsLeft[int(i) % workersCount].append(testRunCount_ - 1u - i);
+    }
+
+    QVariantList modules;
+    const ModuleSources actorModules = actorModuleSources();
+    for (int i=0; i<actorModules.size(); i++) {
+        modules.append(QVariant(QVariantList() << actorModules[i].first << actorModules[i].second));
+    }
+    QVariantMap job;
+    job["program_path"] = sourceProgramPath_;
+    job["program"] = sourceProgram_;
+    job["pre_run"] = preRunSource_;
+    job["post_run"] = postRunSource_;
+    job["modules"] = modules;
+    job["permanent"] = callback_->permanentValues();
+    // Workers apply the same limits to each iteration, see test_worker.py
+    QVariantMap limits;
+    limits["steps"] = activeRunLimits_.steps;
+    limits["wall_time"] = activeRunLimits_.wallTime;
+    limits["cpu_time"] = activeRunLimits_.cpuTime;
+    mutex_->lock();
+    limits["memory"] = memoryLimit_;
+    mutex_->unlock();
+    job["limits"] = limits;
+
+    QProcessEnvironment env = QProcessEnvironment::systemEnvironment();
+    env.insert("PYTHONPATH", PyInterpreterProcess::pythonExtraPath());
+    QList<QProcess*> workers;
+    for (int i=0; i<workersCount; i++) {
+        QProcess * worker = new QProcess;
+        worker->setProcessEnvironment(env);
+        worker->start(PyInterpreterProcess::pythonExecutablePath(), QStringList() << "-m" << "test_worker");
+        job["runs_left"] = runsLeft[i];
+        worker->write(QJsonDocument(QJsonObject::fromVariantMap(job)).toJson(QJsonDocument::Compact) + "\n");
+        worker->closeWriteChannel();
+        workers.append(worker);
+    }
+
+    // Iteration time of this run thread is suspended while workers
+    // run, but worker stuck in C call holding interpreter lock can not
+    // stop itself, so whole batch is limited to wall time of iterations
+    runningParallelIterations_.storeRelease(1);
+    QElapsedTimer batchTimer;
+    batchTimer.start();
+    const qint64 batchTimeLimit = activeRunLimits_.wallTime
+            ? qint64(activeRunLimits_.wallTime) * runsLeft.first().size() + ParallelBatchStartupTime
+            : 0;
+
+    // Each worker pipes are served only while waiting for it
+    bool running = true;
+    while (running && !stopping_.loadAcquire()) {
+        running = false;
+        Q_FOREACH(QProcess * worker, workers) {
+            if (QProcess::NotRunning != worker->state()) {
+                worker->waitForFinished(10);
+                running = running || QProcess::NotRunning != worker->state();
+            }
+        }
+        if (running && batchTimeLimit && batchTimer.elapsed() > batchTimeLimit) {
+            limitExceeded_.testAndSetOrdered(NoLimitExceeded, WallTimeLimitExceeded);
+            break;
+        }
+    }
+    runningParallelIterations_.storeRelease(0);
+    // The last iteration run here gets its own time again
+    iterationStartCpuTime_.storeRelease(runThreadCpuTime());
+    iterationStartTime_.storeRelease(clock_.elapsed());
+    if (NoLimitExceeded != limitExceeded_.loadAcquire()) {
+        Q_FOREACH(QProcess * worker, workers) {
+            worker->kill();
+            worker->waitForFinished();
+            delete worker;
+        }
+        // Other iterations are not run after limit exceeded
+        return true;
+    }
+
+    bool allDone = !stopping_.loadAcquire();
+    int mark = testingResult().isValid() ? testingResult().toInt() : INT_MAX;
+    QVariantMap permanentValues = callback_->permanentValues();
+    Q_FOREACH(QProcess * worker, workers) {
+        if (QProcess::NotRunning != worker->state()) {
+            worker->kill();
+            worker->waitForFinished();
+        }
+        const QVariantMap out = QJsonDocument::fromJson(worker->readAllStandardOutput()).object().toVariantMap();
+        const QVariantList results = out.value("results").toList();
+        allDone = allDone && results.size() == runsLeft[workers.indexOf(worker)].size();
+        Q_FOREACH(const QVariant & result, results) {
+            const QVariantMap iteration = result.toMap();
+            allDone = allDone && !iteration.value("unsupported").toBool();
+            const QString limit = iteration.value("limit").toString();
+            if (!limit.isEmpty()) {
+                limitExceeded_.testAndSetOrdered(NoLimitExceeded, "steps" == limit ? StepsLimitExceeded
+                                                 : "wall_time" == limit ? WallTimeLimitExceeded
+                                                 : "cpu_time" == limit ? CpuTimeLimitExceeded
+                                                 : MemoryLimitExceeded);
+            }
+            if (iteration.value("mark").isValid() && !iteration.value("mark").isNull()) {
+                mark = qMin(mark, iteration.value("mark").toInt());
+            }
+        }
+        const QVariantMap workerPermanentValues = out.value("permanent").toMap();
+        for (QVariantMap::const_iterator it=workerPermanentValues.constBegin(); it!=workerPermanentValues.constEnd(); ++it) {
+            permanentValues[it.key()] = it.value();
+        }
+        const QByteArray errors = worker->readAllStandardError();
+        if (!errors.isEmpty()) {
+            qDebug() << "Test worker: " << errors;
+        }
+        delete worker;
+    }
+
+    if (NoLimitExceeded != limitExceeded_.loadAcquire()) {
+        // Other iterations are not run after limit exceeded
+        return true;
+    }
+    if (!allDone) {
+        // Program uses actors or worker failed, so
+        // iterations are to be run one by one
+        return false;
+    }
+    callback_->setPermanentValues(permanentValues);
+    if (INT_MAX != mark) {
+        mutex_->lock();
+        testingResult_ = QVariant(mark);
+        mutex_->unlock();
+    }
+    return true;
+}
+
+ModuleSources PythonRunThread::actorModuleSources() const
+{
+    ModuleSources result;
+    for (int i=0; i<actorsHandler_->size(); i++) {
+        result.append(qMakePair(actorsHandler_->moduleName(i), actorsHandler_->moduleWrapper(i)));
     }
+    return result;
+}
+
+void PythonRunThread::prepareInterpreters()
+{
+    interpreterPool_->refill(actorModuleSources());
 }
 
 QAbstractItemModel* PythonRunThread::variablesModel() const
@@ -9,12 +9,16 @@ extern "C" {
 #include <QtCore>
 #include <kumir2/runinterface.h>
 
+#include "subinterpreterpool.h"
+#include "executionrecording.h"
+
 
 namespace Python3Language {
 
 class InterpreterCallback;
 class ActorsHandler;
 class VariablesModel;
+class ProgramInterrupter;
 
 using Shared::RunInterface;
 
@@ -23,24 +27,89 @@ struct BreakpointData {
     QString condition;
     quint32 ignoreCount;
     quint32 hitCount;
-    inline explicit BreakpointData(): ignoreCount(0), hitCount(0) {}
+    bool enabled;
+    inline explicit BreakpointData(): ignoreCount(0), hitCount(0), enabled(true) {}
+};
+
+struct BreakpointCondition {
+    QString source;
+    PyObject * code;
+    inline explicit BreakpointCondition(): code(0) {}
+};
+
+struct CodeObjectInfo {
+    QString fileName;
+    bool userCode;
+    int breakpointsVersion;
+    QBitArray breakpointLines;
+    // Lines executed, counted from the first line of code object
+    int firstLineNumber;
+    QBitArray coveredLines;
+    inline explicit CodeObjectInfo(): userCode(false), breakpointsVersion(-1), firstLineNumber(0) {}
+};
+
+// Zero values mean no limit
+struct RunLimits {
+    quint64 steps;
+    int wallTime;
+    int cpuTime;
+    inline explicit RunLimits(): steps(0), wallTime(0), cpuTime(0) {}
+    inline bool isSet() const { return steps || wallTime || cpuTime; }
+};
+
+enum RunLimitExceeded : int {
+    NoLimitExceeded = 0,
+    StepsLimitExceeded,
+    WallTimeLimitExceeded,
+    CpuTimeLimitExceeded,
+    MemoryLimitExceeded
+};
+
+struct LineProfile {
+    QString function;
+    quint64 hits;
+    quint64 nsecs;
+    inline explicit LineProfile(): hits(0), nsecs(0) {}
 };
 
 class PythonRunThread : public QThread
 {
     Q_OBJECT
+    friend class ProgramInterrupter;
 public /*methods*/:
-    static PythonRunThread * instance(QObject *parent = 0, const QString & extraPythonPath = QString());
+    explicit PythonRunThread(ActorsHandler * actorsHandler, const QString & extraPythonPath, QObject *parent);
+    ~PythonRunThread();
+    // Run thread of interpreter holding lock, if any
+    static PythonRunThread * current();
+    inline InterpreterCallback * callback() const { return callback_; }
+    inline ActorsHandler * actorsHandler() const { return actorsHandler_; }
     inline QString errorText() const { QMutexLocker l(mutex_); return errorText_; }
     inline QVariant testingResult() const { QMutexLocker l(mutex_); return testingResult_; }
-    inline int currentLineNumber() const { QMutexLocker l(mutex_); return lineNumber_; }
-    inline unsigned long int stepsCounted() const
-    { QMutexLocker l(mutex_); return stepsCounted_; }
+    inline int currentLineNumber() const { return lineNumber_.loadAcquire(); }
+    // Lines run by program. Blind runs outside testing mode are not
+    // traced, so they count no lines
+    inline unsigned long int stepsCounted() const { return stepsCounted_.load(); }
+    void setStepsCounterInterval(int msec);
     inline void setTestingMode(bool v) { QMutexLocker l(mutex_); testingMode_ = v; }
     inline bool isTestingMode() const { QMutexLocker l(mutex_); return testingMode_; }
+    void setRunLimits(const RunLimits & limits);
+    inline void setMemoryLimit(quint64 bytes) { QMutexLocker l(mutex_); memoryLimit_ = bytes; }
+    inline quint64 peakMemory() const { return peakMemory_.load(); }
+    inline RunLimitExceeded limitExceeded() const { return RunLimitExceeded(limitExceeded_.loadAcquire()); }
+    inline void setProfilingMode(bool v) { QMutexLocker l(mutex_); profilingMode_ = v; }
+    inline QMap<int,LineProfile> lineProfile() const { QMutexLocker l(mutex_); return lineProfile_; }
+    inline void setCoverageMode(bool v) { QMutexLocker l(mutex_); coverageMode_ = v; }
+    inline QMap<int,bool> lineCoverage() const { QMutexLocker l(mutex_); return lineCoverage_; }
+    inline void setRecordingMode(bool v) { QMutexLocker l(mutex_); recordingMode_ = v; }
+    inline void setRecordingMemoryLimit(int bytes) { QMutexLocker l(mutex_); recordingMemoryLimit_ = bytes; }
+    // Moves through history of the last recording run while program
+    // paused or finished, returns false if there is nowhere to move
+    bool stepBackward();
+    bool stepForward();
+    inline QString programFileName() const { QMutexLocker l(mutex_); return sourceProgramPath_; }
     inline bool hasPostRunSource() const { QMutexLocker l(mutex_); return postRunSource_.length() > 0; }
     QAbstractItemModel * variablesModel() const;
-    inline bool canStepOut() const { QMutexLocker l(mutex_); return canStepOut_; }
+    inline bool canStepOut() const { return canStepOut_.loadAcquire(); }
     void setStdInStream(QTextStream * stream);
     void setStdOutStream(QTextStream * stream);
 
@@ -49,6 +118,7 @@ public /*methods*/:
     void forceGlobalVariableValue(const QByteArray & name, PyObject * value);
     inline void setTestRunCount(quint32 n) { QMutexLocker l(mutex_); testRunCount_ = n; }
     inline unsigned long testRunsLeft() const { QMutexLocker l(mutex_); return testRunCount_; }
+    inline void setParallelTestRuns(bool v) { QMutexLocker l(mutex_); parallelTestRuns_ = v; }
 
     void removeAllBreakpoints();
     void insertSingleHitBreakpoint(const BreakpointLocation &location);
@@ -80,6 +150,7 @@ public Q_SLOTS:
         postRunSource_ = postRunSource;
         preTestSource_ = preTestSource;
         postTestSource_ = postTestSource;
+        prepareInterpreters();
     }
 
     void startOrContinue(const Shared::RunInterface::RunMode runMode);
@@ -88,22 +159,89 @@ public Q_SLOTS:
 
 private Q_SLOTS:
     void handlePythonInput();
+    void deliverLineChange();
+    void sampleStepsCounter();
+    void checkRunLimits();
+    void repeatTerminate();
 
 private /*methods*/:
-    explicit PythonRunThread(QObject *parent, const QString & extraPythonPath);
     void reset();
+    void setInterpreterContext();
+    static inline PythonRunThread * fromContext(PyObject * context) {
+        return static_cast<PythonRunThread*>(PyCapsule_GetPointer(context, 0));
+    }
     void run();
     void updateDebuggerVariablesModel(PyFrameObject * current_frame);
     static int python_trace_dispatch(PyObject *obj, PyFrameObject *frame, int what, PyObject *arg);
+#if PY_VERSION_HEX >= 0x030C0000
+    static int python_terminate_dispatch(PyObject *obj, PyFrameObject *frame, int what, PyObject *arg);
+#endif
+    int dispatchEvent(PyFrameObject * frame, PyCodeObject * code, int what, PyObject * exception);
+    void startTracing();
+    void stopTracing();
+#if PY_VERSION_HEX >= 0x030C0000
+    bool startMonitoring();
+    void stopMonitoring();
+    void enableLocalMonitoring(PyCodeObject * code);
+    PyObject* dispatchMonitoringEvent(PyObject * code, int what, PyObject * exception, bool canDisable);
+    static PyObject* monitoring_py_start(PyObject *context, PyObject *const *args, Py_ssize_t nargs);
+    static PyObject* monitoring_py_return(PyObject *context, PyObject *const *args, Py_ssize_t nargs);
+    static PyObject* monitoring_py_unwind(PyObject *context, PyObject *const *args, Py_ssize_t nargs);
+    static PyObject* monitoring_line(PyObject *context, PyObject *const *args, Py_ssize_t nargs);
+    static PyObject* monitoring_raise(PyObject *context, PyObject *const *args, Py_ssize_t nargs);
+#endif
+    CodeObjectInfo & codeObjectInfo(PyCodeObject * code);
+    void clearCodeObjectsCache();
+    void applyForcedGlobalValues(PyObject * globals);
+    void clearForcedGlobalsCache();
+#if PY_VERSION_HEX >= 0x030C0000
+    static int forced_globals_watcher(PyDict_WatchEvent event, PyObject * dict, PyObject * key, PyObject * newValue);
+#endif
+    void applyRequestedMode();
+    void interruptProgram();
+    void storeEscapedException();
+    void formatPendingException();
     void dispatchLineChange();
-    bool checkForBreakpoint(const BreakpointLocation & location);
+    void notifyLineChanged(int lineNumber);
+    qint64 runThreadCpuTime() const;
+    int exceededRunLimit() const;
+    static QString limitExceededMessage(int limit);
+    void startProfiling();
+    void profileLine(PyCodeObject * code, int lineNumber);
+    void finishProfiling();
+    bool moveInRecording(bool backward);
+    void findCoverableLines(PyObject * code);
+    void coverLine(CodeObjectInfo & codeInfo, int lineNumber);
+    void collectCoverage();
+    void finishCoverage();
+    bool checkForBreakpoint(PyFrameObject * frame, CodeObjectInfo & codeInfo, int lineNumber);
+    void updateBreakpointLines();
+    bool evaluateBreakpointCondition(PyFrameObject * frame,
+                                     const BreakpointLocation & location,
+                                     const QString & condition);
     void releaseSemaphores();
+    ModuleSources actorModuleSources() const;
+    bool runParallelTestIterations(quint32 count);
+    void prepareInterpreters();
 
 
 private /*fields*/:
-    static PythonRunThread* self;
+    static const int InterpreterPoolSize;
+    static const int DefaultStepsCounterInterval;
+    static const int LimitsCheckInterval;
+    static const int LimitsWatchdogInterval;
+    static const int TerminateRepeatInterval;
+    static const int InterruptsBeforeEscalation;
+    static const int ParallelBatchStartupTime;
+    static const int DefaultRecordingMemoryLimit;
 
-    QStack<Shared::RunInterface::RunMode> runMode_;
+    // Run mode is requested by GUI thread and applied by run thread on
+    // resume or at next line, with user frames depth to stop at
+    QAtomicInt requestedMode_;
+    QAtomicInt paused_;
+    Shared::RunInterface::RunMode activeMode_;
+    int userFrameDepth_;
+    int targetDepth_;
 
     InterpreterCallback * callback_;
     ActorsHandler* actorsHandler_;
@@ -112,13 +250,46 @@ private /*fields*/:
     QString sourceProgramPath_;
     QString sourceProgram_;    
     QMutex * mutex_;
+    QMutex * interruptMutex_;
+    PyThreadState * programThreadState_;
+    // Exception class raised to terminate program, not accessible by
+    // program code, and number of times it was raised in current run
+    PyObject * terminatedException_;
+    int interruptsCount_;
+    bool traced_;
+#if PY_VERSION_HEX >= 0x030B0000
+    // Attribute name set for each call into library code, see python_trace_dispatch
+    PyObject * traceLinesName_;
+#endif
+    PyObject * monitoring_;
+    PyObject * monitoringDisable_;
+    long monitoringLocalEvents_;
     QString errorText_;
-    int lineNumber_;
-    unsigned long int stepsCounted_;
+    QAtomicInt hasErrorText_;
+    PyObject * pendingException_;
+    QAtomicInt lineNumber_;
+    QAtomicInteger<quint64> stepsCounted_;
     bool justStarted_;
-    bool stopping_;
+    QAtomicInt stopping_;
     QByteArray mainModuleName_;
     bool testingMode_;
+    bool profilingMode_;
+    bool profiling_;
+    int profiledLine_;
+    qint64 profiledLineStart_;
+    QElapsedTimer profileTimer_;
+    QMap<int,LineProfile> lineProfileData_;
+    QMap<int,LineProfile> lineProfile_;
+    bool coverageMode_;
+    bool covering_;
+    bool coverageOnly_;
+    QBitArray coverableLines_;
+    QBitArray lineCoverageData_;
+    QMap<int,bool> lineCoverage_;
+    bool recordingMode_;
+    bool recording_;
+    int recordingMemoryLimit_;
+    ExecutionRecording executionRecording_;
     QSemaphore * runPauseSemaphore_;
     QSemaphore * runInputSemaphore_;
     QVariant testingResult_;
@@ -127,11 +298,58 @@ private /*fields*/:
     QString preTestSource_;
     QString postTestSource_;
     VariablesModel* variablesModel_;
-    bool canStepOut_;
+    SubInterpreterPool* interpreterPool_;
+    QAtomicInt canStepOut_;
     QMap<QByteArray,PyObject*> forcedGlobalValues_;
+    QAtomicInt hasForcedGlobalValues_;
+    QAtomicInt forcedGlobalValuesVersion_;
+    // Forced values are applied again only if changed or if globals
+    // dictionary modified since the last time, by run thread only
+    QVector< QPair<PyObject*,PyObject*> > forcedGlobals_;
+    int forcedGlobalsVersion_;
+    PyObject * forcedGlobalsDict_;
+    bool forcedGlobalsChanged_;
+#if PY_VERSION_HEX >= 0x030C0000
+    int forcedGlobalsWatcher_;
+    bool applyingForcedGlobals_;
+#elif PY_VERSION_HEX >= 0x03060000
+    quint64 forcedGlobalsDictVersion_;
+#endif
+    QHash<PyCodeObject*,CodeObjectInfo> codeObjects_;
     quint32 testRunCount_;
+    bool parallelTestRuns_;
     QSet<BreakpointLocation> singleHits_;
     QMap<BreakpointLocation,BreakpointData> breakpoints_;
+    QAtomicInt hasBreakpoints_;
+    QAtomicInt breakpointsVersion_;
+    int breakpointLinesVersion_;
+    QHash<QString,QBitArray> breakpointLines_;
+    QHash<BreakpointLocation,BreakpointCondition> breakpointConditions_;
+    QAtomicInt pendingLineNumber_;
+    QAtomicInt lineChangePending_;
+    QTimer * stepsTimer_;
+    quint64 stepsReported_;
+    RunLimits runLimits_;
+    RunLimits activeRunLimits_;
+    int limitsCheckCountdown_;
+    QAtomicInt hasRunLimits_;
+    QAtomicInt limitExceeded_;
+    QTimer * limitsTimer_;
+    QTimer * terminateTimer_;
+    QAtomicInteger<qint64> terminateRequestTime_;
+    quint64 memoryLimit_;
+    QAtomicInteger<quint64> peakMemory_;
+    QElapsedTimer clock_;
+    QAtomicInteger<qint64> iterationStartTime_;
+    QAtomicInteger<qint64> iterationStartCpuTime_;
+    // Time limits are applied by test workers to iterations they run
+    QAtomicInt runningParallelIterations_;
+#if defined(Q_OS_WIN32)
+    void * runThreadHandle_;
+#elif defined(Q_OS_UNIX) && !defined(Q_OS_MAC)
+    bool runThreadCpuClockValid_;
+    clockid_t runThreadCpuClock_;
+#endif
 };
 
 } // namespace Python3Language
@@ -1,5 +1,9 @@
 #include "pyutils.h"
 
+extern "C" {
+#include <marshal.h>
+}
+
 #include <iostream>
 
 #ifdef PYTHON_SCRIPT_DEBUG
@@ -457,25 +461,122 @@ extern PyObject* compileModule(
     return result;
 }
 
-static QMap<QString,PyObject*> CreatedModules;
+// Marshalled code objects are not bound to interpreter, so they
+// can be shared between runs in different sub-interpreters
+static const int BytecodeMemoryCacheSize = 32 * 1024 * 1024;
+static QMutex BytecodeCacheMutex;
+static QCache<QByteArray,QByteArray> BytecodeMemoryCache(BytecodeMemoryCacheSize);
+static QString BytecodeCacheDirectory;
+
+extern void setBytecodeCacheDirectory(const QString &path)
+{
+    QMutexLocker l(&BytecodeCacheMutex);
+    BytecodeCacheDirectory = path;
+    if (!path.isEmpty()) {
+        QDir().mkpath(path);
+    }
+}
+
+static QByteArray bytecodeCacheKey(const QString &fileName, const QString &source, int flags)
+{
+    QCryptographicHash hash(QCryptographicHash::Sha1);
+    hash.addData(QByteArray::number(qlonglong(PyImport_GetMagicNumber())));
+    hash.addData(QByteArray::number(flags));
+    hash.addData(fileName.toUtf8());
+    hash.addData(QByteArray(1, '\0'));
+    hash.addData(source.toUtf8());
+    return hash.result().toHex();
+}
+
+extern PyObject* compileModuleCached(
+        const QString &fileName,
+        const QString &source,
+        int * errorLineNumber,
+        QString * errorText,
+        int flags
+        )
+{
+    const QByteArray key = bytecodeCacheKey(fileName, source, flags);
+    QByteArray data;
+    QString cacheFileName;
+
+    BytecodeCacheMutex.lock();
+    if (BytecodeMemoryCache.contains(key)) {
+        data = *BytecodeMemoryCache.object(key);
+    }
+    else if (!BytecodeCacheDirectory.isEmpty()) {
+        cacheFileName = BytecodeCacheDirectory + "/" + QString::fromLatin1(key) + ".kpyc";
+    }
+    BytecodeCacheMutex.unlock();
+
+    if (data.isEmpty() && !cacheFileName.isEmpty()) {
+        QFile cacheFile(cacheFileName);
+        if (cacheFile.open(QIODevice::ReadOnly)) {
+            data = cacheFile.readAll();
+            cacheFile.close();
+        }
+    }
+
+    if (!data.isEmpty()) {
+        PyObject * code = PyMarshal_ReadObjectFromString(data.constData(), data.size());
+        if (code && PyCode_Check(code)) {
+            QMutexLocker l(&BytecodeCacheMutex);
+            if (!BytecodeMemoryCache.contains(key)) {
+                BytecodeMemoryCache.insert(key, new QByteArray(data), data.size());
+            }
+            return code;
+        }
+        // Broken cache file, so compile again
+        Py_XDECREF(code);
+        PyErr_Clear();
+    }
+
+    PyObject * code = compileModule(fileName, source, errorLineNumber, errorText, flags);
+    if (!code) {
+        return 0;
+    }
+    PyObject * marshalled = PyMarshal_WriteObjectToString(code, Py_MARSHAL_VERSION);
+    if (!marshalled) {
+        PyErr_Clear();
+        return code;
+    }
+    data = QByteArray(PyBytes_AS_STRING(marshalled), int(PyBytes_GET_SIZE(marshalled)));
+    Py_DECREF(marshalled);
+
+    QMutexLocker l(&BytecodeCacheMutex);
+    BytecodeMemoryCache.insert(key, new QByteArray(data), data.size());
+    if (!BytecodeCacheDirectory.isEmpty()) {
+        QSaveFile cacheFile(BytecodeCacheDirectory + "/" + QString::fromLatin1(key) + ".kpyc");
+        if (cacheFile.open(QIODevice::WriteOnly)) {
+            cacheFile.write(data);
+            cacheFile.commit();
+        }
+    }
+    return code;
+}
+
+// Might be used by several run threads at once, each one with its own
+// interpreter, so modules are kept separately for each interpreter
+static QMutex CreatedModulesMutex;
+static QHash<PyInterpreterState*,QMap<QString,PyObject*> > CreatedModules;
 
-extern void clearCreatedModules()
+extern void clearCreatedModules(PyInterpreterState *interpreter)
 {
-    Q_FOREACH(PyObject * obj, CreatedModules.values()) {
+    CreatedModulesMutex.lock();
+    const QMap<QString,PyObject*> modules = CreatedModules.take(interpreter);
+    CreatedModulesMutex.unlock();
+    Q_FOREACH(PyObject * obj, modules.values()) {
         Py_XDECREF(obj);
     }
-    CreatedModules.clear();
 }
 
-extern PyObject* createModuleFromSource(
-        PyThreadState *interpreter,
+extern PyObject* execModuleSource(
         const QString &moduleName,
         const QString &moduleSource
         )
 {
     const std::string cname = moduleName.toStdString();
     PyObject* module = 0;
-    PyEval_AcquireThread(interpreter);
     PyObject* code = compileModule("<generated>", moduleSource);
     if (!code) {
         qDebug() << "Error creating " << moduleName;
@@ -488,20 +589,34 @@ extern PyObject* createModuleFromSource(
             printPythonTraceback();
         }
     }
+    return module;
+}
+
+extern void registerCreatedModule(PyInterpreterState *interpreter, const QString &moduleName, PyObject *module)
+{
+    QMutexLocker l(&CreatedModulesMutex);
+    CreatedModules[interpreter][moduleName] = module;
+}
+
+extern PyObject* createModuleFromSource(
+        PyThreadState *interpreter,
+        const QString &moduleName,
+        const QString &moduleSource
+        )
+{
+    PyEval_AcquireThread(interpreter);
+    PyObject* module = execModuleSource(moduleName, moduleSource);
     PyEval_ReleaseThread(interpreter);
     Py_XINCREF(module);
-    CreatedModules[moduleName] = module;
+    registerCreatedModule(interpreter->interp, moduleName, module);
     return module;
 }
 
 extern PyObject* findCreatedModule(const QString &name)
 {
-    if (CreatedModules.contains(name)) {
-        return CreatedModules[name];
-    }
-    else {
-        return 0;
-    }
+    PyInterpreterState * interpreter = PyThreadState_Get()->interp;
+    QMutexLocker l(&CreatedModulesMutex);
+    return CreatedModules.value(interpreter).value(name, 0);
 }
 
 void createSysArgv(const QStringList &arguments)
@@ -3,6 +3,7 @@
 
 extern "C" {
 #include <Python.h>
+#include <frameobject.h>
 }
 
 #include <QtCore>
@@ -38,6 +39,53 @@ struct ValueRepresentation {
 
 extern ValueRepresentation PyObjectToValueRepresentation(const QString & name, PyObject * object);
 
+// Frame objects are opaque since Python 3.11. Code, previous frame and
+// globals are owned by frame while it executes, so borrowed references
+// returned, but frameLocals returns a new reference
+inline PyCodeObject* frameCode(PyFrameObject * frame)
+{
+#if PY_VERSION_HEX >= 0x03090000
+    PyCodeObject * code = PyFrame_GetCode(frame);
+    Py_DECREF(code);
+    return code;
+#else
+    return frame->f_code;
+#endif
+}
+
+inline PyFrameObject* frameBack(PyFrameObject * frame)
+{
+#if PY_VERSION_HEX >= 0x03090000
+    PyFrameObject * back = PyFrame_GetBack(frame);
+    Py_XDECREF(back);
+    return back;
+#else
+    return frame->f_back;
+#endif
+}
+
+inline PyObject* frameGlobals(PyFrameObject * frame)
+{
+#if PY_VERSION_HEX >= 0x030B0000
+    PyObject * globals = PyFrame_GetGlobals(frame);
+    Py_DECREF(globals);
+    return globals;
+#else
+    return frame->f_globals;
+#endif
+}
+
+inline PyObject* frameLocals(PyFrameObject * frame)
+{
+#if PY_VERSION_HEX >= 0x030B0000
+    return PyFrame_GetLocals(frame);
+#else
+    PyFrame_FastToLocals(frame);
+    Py_XINCREF(frame->f_locals);
+    return frame->f_locals;
+#endif
+}
+
 extern QVariant PyObjectToQVariant(PyObject * object);
 extern PyObject* QVariantToPyObject(const QVariant & value);
 
@@ -71,13 +119,37 @@ extern PyObject* compileModule(
         int compileFlags = Py_file_input
         );
 
+// Same as compileModule, but reuses code compiled before from the
+// same source, in memory and in cache directory if set
+extern PyObject* compileModuleCached(
+        const QString &fileName,
+        const QString &source,
+        int * errorLineNumber = 0,
+        QString * errorText = 0,
+        int compileFlags = Py_file_input
+        );
+
+extern void setBytecodeCacheDirectory(const QString & path);
+
 extern PyObject* createModuleFromSource(
         PyThreadState * interpreter,
         const QString & moduleName,
         const QString & moduleSource
         );
 
-extern void clearCreatedModules();
+// Executes module source in current interpreter, lock must be held.
+// Returns new reference to module
+extern PyObject* execModuleSource(
+        const QString & moduleName,
+        const QString & moduleSource
+        );
+
+// Actor modules are registered for interpreter they were created in, and
+// looked up in current interpreter, lock must be held
+extern void registerCreatedModule(PyInterpreterState * interpreter, const QString & moduleName, PyObject * module);
+
+// Releases modules of interpreter before it ends, its lock must be held
+extern void clearCreatedModules(PyInterpreterState * interpreter);
 
 extern PyObject* findCreatedModule(const QString & name);
 
@@ -6,6 +6,7 @@
 #include <QTextBrowser>
 #include <QTextCharFormat>
 #include <QFocusEvent>
+#include <QShowEvent>
 #include <QTextFrame>
 #include <QTextTable>
 #include <QEvent>
@@ -22,6 +23,12 @@
 
 namespace Python3Language {
 
+// Characters of program output not rendered yet before interpreter blocks
+const int SandboxWidget::OutputWindow = 256 * 1024;
+
+// Only head and last characters are shown when single command outputs more
+const int SandboxWidget::OutputTailLimit = 64 * 1024;
+
 SandboxWidget::SandboxWidget(const QString & pythonPath, QWidget *parent)
     : QWidget(parent)
     , _editor(new QTextEdit(this))
@@ -48,7 +55,11 @@ SandboxWidget::SandboxWidget(const QString & pythonPath, QWidget *parent)
 
 void SandboxWidget::createInterpreterProcess()
 {
-    _pyInterpreterProcess = PyInterpreterProcess::create(this);
+    _pyInterpreterProcess = PyInterpreterProcess::create(true, this);
+    if (!_pyInterpreterProcess) {
+        return;
+    }
+    _pyInterpreterProcess->setOutputLimits(OutputWindow, OutputTailLimit);
     connect(_pyInterpreterProcess, SIGNAL(stdoutReceived(QString)), this, SLOT(handleStdOut(QString)));
     connect(_pyInterpreterProcess, SIGNAL(stderrReceived(QString)), this, SLOT(handleStdErr(QString)));
     connect(_pyInterpreterProcess, SIGNAL(inputRequiestReceived(QString)), this, SLOT(addPyInputItem(QString)));
@@ -100,15 +111,17 @@ void SandboxWidget::reset()
 //    commandNumber_ = 0;
 //    resetFlag_ = false;
 
+    // Interpreter process is spawned lazily on first display,
+    // so restart it here only if it was already running
     if (_pyInterpreterProcess) {
         _pyInterpreterProcess->disconnect(this);
         _pyInterpreterProcess->sendExit();
         _pyInterpreterProcess->deleteLater();
+        _pyInterpreterProcess = 0;
         QCoreApplication::processEvents();
+        createInterpreterProcess();
     }
 
-    createInterpreterProcess();
-
     _editor->clear();
     createWelcomeFrame();
     addDefaultInputItem();
@@ -283,7 +296,11 @@ void SandboxWidget::processCurrentInputFrame()
 
     text = lines.join("\n");
 
-    if (text.trimmed().length() > 0) {
+    if (!_pyInterpreterProcess) {
+        createInterpreterProcess();
+    }
+
+    if (text.trimmed().length() > 0 && _pyInterpreterProcess) {
 
         if (plainInput) {
             _pyInterpreterProcess->sendInput(text + "\n");
@@ -486,6 +503,14 @@ void SandboxWidget::performEditOperation(QKeyEvent *event)
     }
 }
 
+void SandboxWidget::showEvent(QShowEvent *event)
+{
+    if (!_pyInterpreterProcess) {
+        createInterpreterProcess();
+    }
+    QWidget::showEvent(event);
+}
+
 void SandboxWidget::focusInEvent(QFocusEvent *event)
 {
     event->accept();
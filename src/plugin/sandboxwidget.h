@@ -21,6 +21,9 @@ class SandboxWidget : public QWidget
 {
     Q_OBJECT
 public:    
+    static const int OutputWindow;
+    static const int OutputTailLimit;
+
     explicit SandboxWidget(const QString &pythonPath, QWidget *parent);
 
 public Q_SLOTS:
@@ -43,6 +46,7 @@ private Q_SLOTS:
 
 private:
     void createInterpreterProcess();
+    void showEvent(QShowEvent *event);
 
     bool eventFilter(QObject *obj, QEvent *evt);
     bool filterKeyPressEvent(QKeyEvent *event);
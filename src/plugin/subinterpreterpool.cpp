@@ -0,0 +1,128 @@
+#include "subinterpreterpool.h"
+#include "pyutils.h"
+
+namespace Python3Language {
+
+class SubInterpreterWarmer : public QRunnable
+{
+public:
+    inline explicit SubInterpreterWarmer(SubInterpreterPool * pool, const ModuleSources & modules)
+        : pool_(pool), modules_(modules) {}
+    inline void run() { pool_->warmUp(modules_); }
+private:
+    SubInterpreterPool * pool_;
+    ModuleSources modules_;
+};
+
+SubInterpreterPool::SubInterpreterPool(const QString &extraPythonPath, int size)
+    : _extraPythonPath(extraPythonPath)
+    , _size(size)
+    , _warming(0)
+{
+    // Interpreters are created one by one not to slow down running program
+    _threadPool.setMaxThreadCount(1);
+}
+
+SubInterpreterPool::~SubInterpreterPool()
+{
+    // Must be called while interpreter lock is not held
+    _threadPool.waitForDone();
+    Q_FOREACH(const Entry & entry, _ready) {
+        discard(entry);
+    }
+    _ready.clear();
+}
+
+PyThreadState * SubInterpreterPool::take(const ModuleSources &modules)
+{
+    Entry entry;
+    QList<Entry> stale;
+    _mutex.lock();
+    while (!_ready.isEmpty() && !entry.interp) {
+        Entry candidate = _ready.takeFirst();
+        if (candidate.sources == modules) {
+            entry = candidate;
+        }
+        else {
+            stale.append(candidate);
+        }
+    }
+    _mutex.unlock();
+
+    Q_FOREACH(const Entry & staleEntry, stale) {
+        discard(staleEntry);
+    }
+
+    if (!entry.interp) {
+        return 0;
+    }
+    for (int i=0; i<entry.sources.size(); i++) {
+        registerCreatedModule(entry.interp, entry.sources.at(i).first, entry.modules.at(i));
+    }
+    return PyThreadState_New(entry.interp);
+}
+
+void SubInterpreterPool::refill(const ModuleSources &modules)
+{
+    QMutexLocker l(&_mutex);
+    const int missing = _size - _ready.size() - _warming;
+    for (int i=0; i<missing; i++) {
+        _warming ++;
+        _threadPool.start(new SubInterpreterWarmer(this, modules));
+    }
+}
+
+void SubInterpreterPool::warmUp(const ModuleSources &modules)
+{
+    Entry entry;
+    entry.sources = modules;
+
+    PyGILState_STATE gil = PyGILState_Ensure();
+    PyThreadState * mainState = PyThreadState_Get();
+    PyThreadState * py = Py_NewInterpreter();
+    if (py) {
+#ifdef Q_OS_WIN32
+        prepareBundledSysPath();
+#else
+        appendToSysPath(_extraPythonPath);
+#endif
+        PyObject * py_run_wrapper = PyImport_ImportModule("run_wrapper");
+        if (py_run_wrapper) {
+            Py_DECREF(py_run_wrapper);
+            for (int i=0; i<modules.size(); i++) {
+                entry.modules.append(execModuleSource(modules.at(i).first, modules.at(i).second));
+            }
+            // Thread state is bound to this thread, so drop it and let
+            // the run thread create its own one for the same interpreter
+            entry.interp = py->interp;
+            PyThreadState_Clear(py);
+            PyThreadState_Swap(mainState);
+            PyThreadState_Delete(py);
+        }
+        else {
+            printPythonTraceback();
+            Py_EndInterpreter(py);
+            PyThreadState_Swap(mainState);
+        }
+    }
+    PyGILState_Release(gil);
+
+    QMutexLocker l(&_mutex);
+    _warming --;
+    if (entry.interp) {
+        _ready.append(entry);
+    }
+}
+
+void SubInterpreterPool::discard(const Entry &entry)
+{
+    PyThreadState * py = PyThreadState_New(entry.interp);
+    PyEval_AcquireThread(py);
+    Q_FOREACH(PyObject * module, entry.modules) {
+        Py_XDECREF(module);
+    }
+    Py_EndInterpreter(py);
+    PyEval_ReleaseLock();
+}
+
+} // namespace Python3Language
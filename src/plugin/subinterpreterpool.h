@@ -0,0 +1,53 @@
+#ifndef PYTHON3LANGUAGE_SUBINTERPRETERPOOL_H
+#define PYTHON3LANGUAGE_SUBINTERPRETERPOOL_H
+
+extern "C" {
+#include <Python.h>
+}
+
+#include <QtCore>
+
+namespace Python3Language {
+
+// Pairs of module name and module source
+typedef QList< QPair<QString,QString> > ModuleSources;
+
+class SubInterpreterPool
+{
+    friend class SubInterpreterWarmer;
+public /*methods*/:
+    explicit SubInterpreterPool(const QString & extraPythonPath, int size);
+    ~SubInterpreterPool();
+
+    // Returns new thread state of warmed up interpreter for calling thread,
+    // or 0 if there is no one ready with the same modules. Interpreter lock
+    // is not held, modules are registered as created ones
+    PyThreadState * take(const ModuleSources & modules);
+
+    // Starts warming up interpreters in background up to pool size
+    void refill(const ModuleSources & modules);
+
+private /*types*/:
+    struct Entry {
+        PyInterpreterState * interp;
+        ModuleSources sources;
+        QList<PyObject*> modules;
+        inline explicit Entry(): interp(0) {}
+    };
+
+private /*methods*/:
+    void warmUp(const ModuleSources & modules);
+    static void discard(const Entry & entry);
+
+private /*fields*/:
+    QString _extraPythonPath;
+    int _size;
+    QMutex _mutex;
+    QList<Entry> _ready;
+    int _warming;
+    QThreadPool _threadPool;
+};
+
+} // namespace Python3Language
+
+#endif // PYTHON3LANGUAGE_SUBINTERPRETERPOOL_H
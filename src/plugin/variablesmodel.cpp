@@ -80,27 +80,35 @@ void VariablesModel::clearAllItems()
 void VariablesModel::update(PyFrameObject *currentFrame)
 {
     // Update globals
-    ValueRepresentation globals = PyObjectToValueRepresentation("", currentFrame->f_globals);
+    ValueRepresentation globals = PyObjectToValueRepresentation("", frameGlobals(currentFrame));
     Q_EMIT updateGlobalsRequest(globals);
 
     // Update all frames locals
     QList<ValueRepresentation> localsList;
 
     while (currentFrame) {
-        PyFrame_FastToLocals(currentFrame);
-        if (currentFrame->f_locals && currentFrame->f_globals!=currentFrame->f_locals) {
-            ValueRepresentation locals = PyObjectToValueRepresentation("", currentFrame->f_locals);
-            PyObject * py_name = currentFrame->f_code->co_name;
+        PyObject * frameLocalsDict = frameLocals(currentFrame);
+        if (frameLocalsDict && frameGlobals(currentFrame)!=frameLocalsDict) {
+            ValueRepresentation locals = PyObjectToValueRepresentation("", frameLocalsDict);
+            PyObject * py_name = frameCode(currentFrame)->co_name;
             QString funcName = PyUnicodeToQString(py_name);
             locals.name = funcName;
             localsList.append(locals); // topmost frame at begin
         }
-        currentFrame = currentFrame->f_back;
+        Py_XDECREF(frameLocalsDict);
+        currentFrame = frameBack(currentFrame);
     }
 
     Q_EMIT updateLocalsRequest(localsList);
 }
 
+void VariablesModel::update(const ValueRepresentation &globals, const QList<ValueRepresentation> &locals)
+{
+    // Values taken by program running in another process
+    Q_EMIT updateGlobalsRequest(globals);
+    Q_EMIT updateLocalsRequest(locals);
+}
+
 void VariablesModel::updateGlobals(const ValueRepresentation &source)
 {
     VariablesModelItem * target = 0;
@@ -46,6 +46,7 @@ class VariablesModel
 public:
     explicit VariablesModel(QObject *parent = 0);
     void update(PyFrameObject * currentFrame);
+    void update(const ValueRepresentation & globals, const QList<ValueRepresentation> & locals);
     void resetModel();
 
 Q_SIGNALS: